@@ -19,6 +19,7 @@ limitations under the License.
 #include "codeGen.h"
 #include "fppObject.h"
 #include "fppType.h"
+#include "fppModel.h"
 #include "frontends/p4/enumInstance.h"
 #include "frontends/p4/methodInstance.h"
 #include "frontends/common/resolveReferences/referenceMap.h"
@@ -136,8 +137,10 @@ bool CodeGenInspector::preorder(const IR::Member* expression) {
     if (ei == nullptr) {
         visit(expression->expr);
         builder->append(".");
+        builder->append(expression->member);
+    } else {
+        builder->append(FPPModel::global(expression->member));
     }
-    builder->append(expression->member);
     return false;
 }
 
@@ -200,19 +203,19 @@ bool CodeGenInspector::preorder(const IR::Type_Typedef* type) {
     builder->append("typedef ");
     et->emit(builder);
     builder->spc();
-    builder->append(type->name);
+    builder->append(FPPModel::global(type->name));
     builder->endOfStatement();
     return false;
 }
 
 bool CodeGenInspector::preorder(const IR::Type_Enum* type) {
     builder->append("enum ");
-    builder->append(type->name);
+    builder->append(FPPModel::global(type->name));
     builder->spc();
     builder->blockStart();
     for (auto e : *type->getDeclarations()) {
         builder->emitIndent();
-        builder->append(e->getName().name);
+        builder->append(FPPModel::global(e->getName().name));
         builder->appendLine(",");
     }
     builder->blockEnd(true);
@@ -39,9 +39,20 @@ void run_fpp_backend(const FPPOptions& options, const IR::ToplevelBlock* topleve
         return;
     }
 
+    if (!options.prefix.isNullOrEmpty())
+        FPPModel::setPrefix(options.prefix);
+
     Target* target;
     if (options.target.isNullOrEmpty()) {
         target = new CTarget();
+    } else if (options.target == "avx2") {
+        // Only the verification of fast paths is vectorized; without one
+        // the output would be the C target's.
+        if (options.fastPaths.empty()) {
+            ::error("--target avx2 requires --fast-path");
+            return;
+        }
+        target = new AVX2Target();
     } else {
         ::error("Unknown target %s", options.target);
         return;
@@ -0,0 +1,216 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "fppChecksum.h"
+#include "fppModel.h"
+
+namespace FPP {
+
+cstring FPPChecksum::kind(const IR::Type_Header* type) {
+    auto anno = type->annotations->getSingle("checksum");
+    if (anno == nullptr)
+        return nullptr;
+    auto str = anno->expr.size() == 1 ? anno->expr.at(0)->to<IR::StringLiteral>() : nullptr;
+    if (str == nullptr || (str->value != "ipv4" && str->value != "ipv6" &&
+                           str->value != "tcp" && str->value != "udp")) {
+        ::error("%1%: expected @checksum(\"ipv4\"), (\"ipv6\"), (\"tcp\") or (\"udp\")", anno);
+        return nullptr;
+    }
+    return str->value;
+}
+
+bool FPPChecksum::verified(const IR::Type_Header* type) {
+    auto k = kind(type);
+    return k != nullptr && k != "ipv6";
+}
+
+std::set<cstring> FPPChecksum::kinds(const IR::P4Program* program) {
+    std::set<cstring> result;
+    for (auto d : program->objects) {
+        if (auto ht = d->to<IR::Type_Header>()) {
+            auto k = kind(ht);
+            if (k != nullptr)
+                result.insert(k);
+        }
+    }
+    return result;
+}
+
+// Sums are kept as 64-bit sums of words loaded in host order. A one's
+// complement sum does not depend on the byte order, so only the numbers
+// added to the pseudo-header are converted with htons. The AVX2 kernel is
+// used when the code is compiled for AVX2; with 'dispatch' it is also
+// compiled on its own for AVX2 and selected when the host supports it.
+void FPPChecksum::emitHelpers(CodeBuilder* builder, bool dispatch) {
+    cstring sum = FPPModel::reserved("csum");
+    cstring scalar = FPPModel::reserved("csum_scalar");
+    cstring avx2 = FPPModel::reserved("csum_avx2");
+    cstring fold = FPPModel::reserved("csum_fold");
+    builder->appendFormat("static uint64_t %s(const uint8_t *p, uint32_t len, uint64_t sum)",
+                          scalar.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    for (; len >= 4; len -= 4, p += 4) {");
+    builder->appendLine("        uint32_t word;");
+    builder->appendLine("        memcpy(&word, p, 4);");
+    builder->appendLine("        sum += word;");
+    builder->appendLine("    }");
+    builder->appendLine("    if (len >= 2) {");
+    builder->appendLine("        uint16_t word;");
+    builder->appendLine("        memcpy(&word, p, 2);");
+    builder->appendLine("        sum += word;");
+    builder->appendLine("        len -= 2, p += 2;");
+    builder->appendLine("    }");
+    builder->appendLine("    if (len > 0) {");
+    builder->appendLine("        uint16_t word = 0;");
+    builder->appendLine("        memcpy(&word, p, 1);");
+    builder->appendLine("        sum += word;");
+    builder->appendLine("    }");
+    builder->appendLine("    return sum;");
+    builder->blockEnd(true);
+    builder->newline();
+
+    if (!dispatch)
+        builder->appendLine("#ifdef __AVX2__");
+    builder->appendLine("#include <immintrin.h>");
+    builder->newline();
+    builder->appendFormat("__attribute__((target(\"avx2\"))) static uint64_t "
+                          "%s(const uint8_t *p, uint32_t len, uint64_t sum)", avx2.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    /* 16-bit words are widened into 32-bit lanes, two per lane and block;");
+    builder->appendLine("       a lane cannot overflow within 32768 blocks. */");
+    builder->appendLine("    while (len >= 32) {");
+    builder->appendLine("        uint32_t blocks = len / 32 < 32768 ? len / 32 : 32768;");
+    builder->appendLine("        __m256i zero = _mm256_setzero_si256(), acc = zero;");
+    builder->appendLine("        for (uint32_t i = 0; i < blocks; i++, p += 32) {");
+    builder->appendLine("            __m256i v = _mm256_loadu_si256((const __m256i *) p);");
+    builder->appendLine("            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));");
+    builder->appendLine("            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));");
+    builder->appendLine("        }");
+    builder->appendLine("        len -= blocks * 32;");
+    builder->appendLine("        uint32_t lanes[8];");
+    builder->appendLine("        _mm256_storeu_si256((__m256i *) lanes, acc);");
+    builder->appendLine("        for (int k = 0; k < 8; k++)");
+    builder->appendLine("            sum += lanes[k];");
+    builder->appendLine("    }");
+    builder->appendFormat("    return %s(p, len, sum);", scalar.c_str());
+    builder->newline();
+    builder->blockEnd(true);
+    if (!dispatch)
+        builder->appendLine("#endif");
+    builder->newline();
+
+    builder->appendFormat("static uint64_t %s(const uint8_t *p, uint32_t len, uint64_t sum)",
+                          sum.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("#ifdef __AVX2__");
+    builder->appendFormat("    return %s(p, len, sum);", avx2.c_str());
+    builder->newline();
+    builder->appendLine("#else");
+    if (dispatch) {
+        builder->appendLine("    if (__builtin_cpu_supports(\"avx2\"))");
+        builder->appendFormat("        return %s(p, len, sum);", avx2.c_str());
+        builder->newline();
+    }
+    builder->appendFormat("    return %s(p, len, sum);", scalar.c_str());
+    builder->newline();
+    builder->appendLine("#endif");
+    builder->blockEnd(true);
+    builder->newline();
+
+    builder->appendFormat("static uint16_t %s(uint64_t sum)", fold.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    while (sum >> 16)");
+    builder->appendLine("        sum = (sum & 0xffff) + (sum >> 16);");
+    builder->appendLine("    return (uint16_t) sum;");
+    builder->blockEnd(true);
+    builder->newline();
+
+    // 'l3' is the byte offset of the network header shifted left by 4
+    // bits and its IP version, 0 before the first one.
+    builder->appendFormat("static uint8_t %s(const uint8_t *packet, uint32_t packet_len, "
+                          "uint32_t off, uint64_t *l3)",
+                          FPPModel::reserved("checksum_ipv4").c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    uint32_t hlen = (packet[off] & 0x0f) * 4;");
+    builder->appendLine("    *l3 = (uint64_t) off << 4 | 4;");
+    builder->appendLine("    if (hlen < 20 || off + hlen > packet_len)");
+    builder->appendLine("        return 0;");
+    builder->appendFormat("    return %s(%s(packet + off, hlen, 0)) == 0xffff;",
+                          fold.c_str(), sum.c_str());
+    builder->newline();
+    builder->blockEnd(true);
+    builder->newline();
+
+    // The TCP or UDP segment ends where the payload of the network
+    // header ends. In a fragment that is only part of the segment, so the
+    // checksum is left unverified (2); bit 3 of 'l3' marks an IPv6 header
+    // followed by a fragment header.
+    builder->appendFormat("static uint8_t %s(const uint8_t *packet, uint32_t packet_len, "
+                          "uint32_t off, uint64_t l3, uint8_t proto)",
+                          FPPModel::reserved("checksum_l4").c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    uint32_t ip = (uint32_t) (l3 >> 4), end;");
+    builder->appendLine("    uint64_t sum;");
+    builder->appendLine("    if (l3 & 8)");
+    builder->appendLine("        return 2;");
+    builder->appendLine("    if ((l3 & 15) == 4) {");
+    builder->appendLine("        if (((packet[ip + 6] & 0x3f) | packet[ip + 7]) != 0)");
+    builder->appendLine("            return 2;");
+    builder->appendLine("        end = ip + ((uint32_t) packet[ip + 2] << 8 | packet[ip + 3]);");
+    builder->appendFormat("        sum = %s(packet + ip + 12, 8, 0);", sum.c_str());
+    builder->newline();
+    builder->appendLine("    } else if ((l3 & 15) == 6) {");
+    builder->appendLine("        end = ip + 40 + ((uint32_t) packet[ip + 4] << 8 | packet[ip + 5]);");
+    builder->appendFormat("        sum = %s(packet + ip + 8, 32, 0);", sum.c_str());
+    builder->newline();
+    builder->appendLine("    } else {");
+    builder->appendLine("        return 0;");
+    builder->appendLine("    }");
+    builder->appendLine("    if (end > packet_len || end < off + (proto == 6 ? 20 : 8))");
+    builder->appendLine("        return 0;");
+    builder->appendLine("    /* a zero UDP checksum over IPv4 is not computed */");
+    builder->appendLine("    if (proto == 17 && (l3 & 15) == 4 && packet[off + 6] == 0 && packet[off + 7] == 0)");
+    builder->appendLine("        return 1;");
+    builder->appendLine("    sum += htons(proto) + htons((uint16_t) (end - off));");
+    builder->appendFormat("    return %s(%s(packet + off, end - off, sum)) == 0xffff;",
+                          fold.c_str(), sum.c_str());
+    builder->newline();
+    builder->blockEnd(true);
+}
+
+void FPPChecksum::emitVerify(CodeBuilder* builder, cstring kind, cstring object,
+                             cstring offset, cstring l3) {
+    builder->emitIndent();
+    if (kind == "ipv6")
+        builder->appendFormat("%s = (uint64_t) (%s) << 4 | 6;", l3.c_str(), offset.c_str());
+    else if (kind == "ipv4")
+        builder->appendFormat("%s.checksum_valid = %s(packet, packet_len, %s, &%s);",
+                              object.c_str(), FPPModel::reserved("checksum_ipv4").c_str(),
+                              offset.c_str(), l3.c_str());
+    else
+        builder->appendFormat("%s.checksum_valid = %s(packet, packet_len, %s, %s, %d);",
+                              object.c_str(), FPPModel::reserved("checksum_l4").c_str(),
+                              offset.c_str(), l3.c_str(), kind == "tcp" ? 6 : 17);
+    builder->newline();
+}
+
+}  // namespace FPP
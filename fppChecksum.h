@@ -0,0 +1,52 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPCHECKSUM_H_
+#define _BACKENDS_FPP_FPPCHECKSUM_H_
+
+#include <set>
+
+#include "ir/ir.h"
+#include "fppObject.h"
+
+namespace FPP {
+
+// Checksum verification of headers annotated with @checksum("ipv4"),
+// @checksum("tcp") or @checksum("udp"); the result is stored in the
+// checksum_valid member of the header structure, 2 if the TCP or UDP
+// checksum cannot be verified because the packet is a fragment. A header annotated with
+// @checksum("ipv6") has no checksum of its own but, like an IPv4 header,
+// provides the pseudo-header of the TCP and UDP headers following it.
+class FPPChecksum {
+ public:
+    // Kind of the checksum of a header, nullptr if it is not annotated.
+    static cstring kind(const IR::Type_Header* type);
+    // The header structure has a checksum_valid member.
+    static bool verified(const IR::Type_Header* type);
+    // Kinds used by the headers of the program.
+    static std::set<cstring> kinds(const IR::P4Program* program);
+    // Sum kernels and the verification function of each kind. With
+    // 'dispatch' the AVX2 kernel is selected at run time.
+    static void emitHelpers(CodeBuilder* builder, bool dispatch);
+    // Verifies the header 'object' starting at byte 'offset' of 'packet'
+    // and tracks the network layer header in 'l3'.
+    static void emitVerify(CodeBuilder* builder, cstring kind, cstring object, cstring offset,
+                           cstring l3);
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPCHECKSUM_H_ */
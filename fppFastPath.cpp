@@ -0,0 +1,310 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+#include <deque>
+#include <set>
+
+#include "lib/stringify.h"
+#include "fppFastPath.h"
+#include "fppProfile.h"
+
+namespace FPP {
+
+namespace {
+// Returns false only if 'keyset' cannot match the key value 'v'.
+bool mayMatch(const IR::Expression* keyset, uint64_t v) {
+    if (auto c = keyset->to<IR::Constant>())
+        return c->asUnsigned() == v;
+    if (auto mask = keyset->to<IR::Mask>()) {
+        auto left = mask->left->to<IR::Constant>();
+        auto right = mask->right->to<IR::Constant>();
+        if (left == nullptr || right == nullptr)
+            return true;
+        return ((left->asUnsigned() ^ v) & right->asUnsigned()) == 0;
+    }
+    if (auto range = keyset->to<IR::Range>()) {
+        auto left = range->left->to<IR::Constant>();
+        auto right = range->right->to<IR::Constant>();
+        if (left == nullptr || right == nullptr)
+            return true;
+        return left->asUnsigned() <= v && v <= right->asUnsigned();
+    }
+    return true;
+}
+}  // namespace
+
+std::vector<const FPPTransition*>
+FPPFastPath::shortestPath(const FPPParser* parser, cstring terminal) {
+    std::map<const FPPParserState*, const FPPTransition*> reachedBy;
+    std::deque<const FPPParserState*> queue;
+    auto start = parser->getState(IR::ParserState::start);
+    queue.push_back(start);
+    reachedBy[start] = nullptr;
+
+    std::vector<const FPPTransition*> result;
+    while (!queue.empty()) {
+        auto ps = queue.front();
+        queue.pop_front();
+        if (ps->state->name.name == terminal) {
+            for (auto t = reachedBy[ps]; t != nullptr; t = reachedBy[t->from])
+                result.push_back(t);
+            std::reverse(result.begin(), result.end());
+            return result;
+        }
+        for (auto t : ps->transitions) {
+            auto succ = parser->getState(t->to);
+            if (succ == nullptr || succ->state->isBuiltin() || reachedBy.count(succ) != 0)
+                continue;
+            reachedBy[succ] = t;
+            queue.push_back(succ);
+        }
+    }
+    return result;
+}
+
+std::vector<const FPPTransition*> FPPFastPath::hottestPath(const FPPParser* parser) {
+    std::vector<const FPPTransition*> result;
+    std::set<const FPPParserState*> visited;
+    const FPPParserState* ps = parser->getState(IR::ParserState::start);
+    while (ps != nullptr && visited.count(ps) == 0) {
+        visited.insert(ps);
+        const FPPTransition* best = nullptr;
+        for (auto t : ps->transitions) {
+            auto succ = parser->getState(t->to);
+            if (succ == nullptr || succ->state->isBuiltin())
+                continue;
+            if (parser->profile->count(t) > 0 &&
+                (best == nullptr || parser->profile->count(t) > parser->profile->count(best)))
+                best = t;
+        }
+        if (best == nullptr)
+            break;
+        result.push_back(best);
+        ps = parser->getState(best->to);
+    }
+    return result;
+}
+
+bool FPPFastPath::build(const std::vector<const FPPTransition*>& path) {
+    FPPStaticOffsets offsets(parser);
+
+    // The terminal state itself is included too, without a verified transition.
+    // States run without bounds checks, so their headers must lie within
+    // the bytes verified up front.
+    for (size_t i = 0; i <= path.size(); i++) {
+        auto ps = i < path.size() ? path[i]->from : parser->getState(terminal);
+        if (offsets.dynamic || !offsets.simulate(ps, maxBytes * 8))
+            break;
+        states.push_back(ps);
+        length = std::max(length, ROUNDUP(offsets.offset, 8));
+
+        auto t = i < path.size() ? path[i] : nullptr;
+        if (t == nullptr || !verify(t, offsets)) {
+            transitions.push_back(nullptr);
+            break;
+        }
+        transitions.push_back(t);
+    }
+
+    if (states.empty())
+        return false;
+
+    for (unsigned i = 0; i < maxBytes; i++) {
+        if (mask[i] != 0)
+            length = std::max(length, ROUNDUP(i + 1, 8) * 8);
+    }
+    return true;
+}
+
+bool FPPFastPath::verify(const FPPTransition* transition, const FPPStaticOffsets& offsets) {
+    auto select = transition->from->state->selectExpression;
+    if (select == nullptr)
+        return false;
+    if (select->is<IR::PathExpression>())
+        return true;
+
+    auto se = select->to<IR::SelectExpression>();
+    if (se == nullptr || transition->selectCase == nullptr || se->select->components.size() != 1)
+        return false;
+    auto keyset = transition->selectCase->keyset->to<IR::Constant>();
+    if (keyset == nullptr)
+        return false;
+
+    unsigned bitOffset, width;
+    uint64_t keyMask;
+    if (!offsets.keyBits(se->select->components.at(0), bitOffset, width, keyMask))
+        return false;
+    uint64_t v = keyset->asUnsigned();
+    if ((v & ~keyMask) != 0 || bitOffset + width > maxBytes * 8)
+        return false;
+    // The select takes the first matching case, which must be this one.
+    for (auto t : transition->from->transitions) {
+        if (t->index >= transition->index)
+            break;
+        if (t->selectCase == nullptr || mayMatch(t->selectCase->keyset, v))
+            return false;
+    }
+
+    setBits(bitOffset, width, v, keyMask);
+    return true;
+}
+
+void FPPFastPath::setBits(unsigned bitOffset, unsigned width, uint64_t v, uint64_t keyMask) {
+    for (unsigned i = 0; i < width; i++) {
+        unsigned bit = width - 1 - i;
+        if (((keyMask >> bit) & 1) == 0)
+            continue;
+        unsigned pos = bitOffset + i;
+        uint8_t m = 1 << (7 - pos % 8);
+        mask[pos / 8] |= m;
+        if ((v >> bit) & 1)
+            value[pos / 8] |= m;
+    }
+}
+
+cstring FPPFastPath::matchFunction() const {
+    return FPPModel::reserved("fast_path_") + Util::toString(id);
+}
+
+cstring FPPFastPath::label() const {
+    return FPPModel::reserved("fastPath") + Util::toString(id);
+}
+
+cstring FPPFastPath::laneMatchFunction() const {
+    return matchFunction() + "_x4";
+}
+
+void FPPFastPath::emitMatch(CodeBuilder* builder) const {
+    unsigned words = 0;
+    for (unsigned i = 0; i < maxBytes; i++) {
+        if (mask[i] != 0)
+            words = i / 8 + 1;
+    }
+
+    builder->appendFormat("/* fast path to %s */", terminal.c_str());
+    builder->newline();
+    builder->appendFormat("static inline int %s(const uint8_t *packet, uint32_t packet_len)",
+                          matchFunction().c_str());
+    builder->newline();
+    builder->blockStart();
+
+    if (words != 0) {
+        auto table = [&](const char* name, const std::vector<uint8_t>& bytes) {
+            builder->emitIndent();
+            builder->appendFormat("static const uint8_t %s[%d] = { ", name, words * 8);
+            for (unsigned i = 0; i < words * 8; i++)
+                builder->appendFormat(i == 0 ? "0x%02x" : ", 0x%02x", bytes[i]);
+            builder->append(" }");
+            builder->endOfStatement(true);
+        };
+        table("mask", mask);
+        table("value", value);
+        builder->newline();
+    }
+
+    builder->emitIndent();
+    builder->appendFormat("if (packet_len < %d)", length);
+    builder->newline();
+    builder->increaseIndent();
+    builder->emitIndent();
+    builder->appendLine("return 0;");
+    builder->decreaseIndent();
+
+    builder->emitIndent();
+    builder->append("return ");
+    if (words == 0) {
+        builder->append("1");
+    } else {
+        builder->append("(");
+        bool first = true;
+        for (unsigned i = 0; i < words; i++) {
+            bool used = false;
+            for (unsigned j = 0; j < 8; j++)
+                used = used || mask[i * 8 + j] != 0;
+            if (!used)
+                continue;
+            if (!first) {
+                builder->append(" |");
+                builder->newline();
+                builder->emitIndent();
+                builder->append("        ");
+            }
+            first = false;
+            builder->appendFormat("((load_dword(packet, %d) ^ load_dword(value, %d)) & "
+                                  "load_dword(mask, %d))", i * 8, i * 8, i * 8);
+        }
+        builder->append(") == 0");
+    }
+    builder->endOfStatement(true);
+    builder->blockEnd(true);
+    builder->newline();
+}
+
+// Lanes too short for the fast path are masked out of the gathers, so no
+// byte past the end of a packet is read. The constants are the mask and
+// value bytes loaded as little-endian words, like load_dword on x86.
+void FPPFastPath::emitLaneMatch(CodeBuilder* builder) const {
+    auto word = [](const std::vector<uint8_t>& bytes, unsigned index) {
+        uint64_t w = 0;
+        for (unsigned j = 0; j < 8; j++)
+            w |= (uint64_t) bytes[index * 8 + j] << (8 * j);
+        return static_cast<unsigned long long>(w);
+    };
+
+    builder->appendFormat("static inline unsigned %s(const uint8_t *const *packets, "
+                          "const uint32_t *lens)", laneMatchFunction().c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("__m256i ptrs = _mm256_loadu_si256((const __m256i *) packets)");
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("__m256i ok = _mm256_cmpgt_epi64(_mm256_cvtepu32_epi64("
+                          "_mm_loadu_si128((const __m128i *) lens)), "
+                          "_mm256_set1_epi64x(%d))", static_cast<int>(length) - 1);
+    builder->endOfStatement(true);
+
+    for (unsigned i = 0; i < maxBytes / 8; i++) {
+        if (word(mask, i) == 0)
+            continue;
+        builder->emitIndent();
+        builder->appendFormat("ok = _mm256_and_si256(ok, _mm256_cmpeq_epi64(_mm256_and_si256("
+                              "_mm256_mask_i64gather_epi64(_mm256_setzero_si256(), "
+                              "(const long long *) 0, _mm256_add_epi64(ptrs, "
+                              "_mm256_set1_epi64x(%d)), ok, 1), "
+                              "_mm256_set1_epi64x(0x%llxULL)), _mm256_set1_epi64x(0x%llxULL)))",
+                              i * 8, word(mask, i), word(value, i));
+        builder->endOfStatement(true);
+    }
+
+    builder->emitIndent();
+    builder->append("return _mm256_movemask_pd(_mm256_castsi256_pd(ok))");
+    builder->endOfStatement(true);
+    builder->blockEnd(true);
+    builder->newline();
+}
+
+void FPPFastPath::emit(CodeBuilder* builder) const {
+    builder->emitIndent();
+    builder->appendFormat("%s: ", label().c_str());
+    builder->blockStart();
+    for (size_t i = 0; i < states.size(); i++)
+        states[i]->emitSpeculative(builder, transitions[i], i + 1 < states.size());
+    builder->blockEnd(true);
+}
+
+}  // namespace FPP
@@ -0,0 +1,69 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPFASTPATH_H_
+#define _BACKENDS_FPP_FPPFASTPATH_H_
+
+#include "fppParser.h"
+#include "fppStaticOffsets.h"
+
+namespace FPP {
+
+// Speculative straight-line parser for one path through the state graph.
+// Select keys along the path that lie at statically known offsets within
+// the first maxBytes of the packet are verified up front with masked
+// 64-bit compares; the states are then emitted back to back without
+// bounds checks or switches. The last state either jumps to its verified
+// successor or evaluates its select as usual.
+class FPPFastPath {
+    const FPPParser* parser;
+
+    bool verify(const FPPTransition* transition, const FPPStaticOffsets& offsets);
+    void setBits(unsigned bitOffset, unsigned width, uint64_t value, uint64_t keyMask);
+
+ public:
+    static const unsigned maxBytes = 64;
+
+    unsigned id;
+    cstring  terminal;
+    std::vector<const FPPParserState*> states;
+    // Verified transition out of each state; only the last may be nullptr.
+    std::vector<const FPPTransition*>  transitions;
+    std::vector<uint8_t> mask, value;
+    unsigned length;  // bytes the packet must have to take the fast path
+
+    FPPFastPath(const FPPParser* parser, unsigned id, cstring terminal) :
+            parser(parser), id(id), terminal(terminal),
+            mask(maxBytes, 0), value(maxBytes, 0), length(0) {}
+
+    // Transitions from start to the terminal state; empty if unreachable.
+    static std::vector<const FPPTransition*> shortestPath(const FPPParser* parser,
+                                                          cstring terminal);
+    static std::vector<const FPPTransition*> hottestPath(const FPPParser* parser);
+    bool build(const std::vector<const FPPTransition*>& path);
+
+    cstring matchFunction() const;
+    cstring label() const;
+    cstring laneMatchFunction() const;
+    void emitMatch(CodeBuilder* builder) const;
+    // Verifies four packets at once, returns a bitmask of matching lanes.
+    void emitLaneMatch(CodeBuilder* builder) const;
+    void emit(CodeBuilder* builder) const;
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPFASTPATH_H_ */
@@ -0,0 +1,371 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "fppFilter.h"
+#include "fppModel.h"
+
+namespace FPP {
+
+namespace {
+std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t");
+    size_t e = s.find_last_not_of(" \t");
+    return b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+}
+
+// Splits 's' at each 'sep' outside parentheses; returns false if the
+// parentheses do not match.
+bool split(const std::string& s, const char* sep, std::vector<std::string>& parts) {
+    int depth = 0;
+    size_t start = 0;
+    size_t len = strlen(sep);
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '(') {
+            depth++;
+        } else if (s[i] == ')') {
+            if (--depth < 0)
+                return false;
+        } else if (depth == 0 && s.compare(i, len, sep) == 0) {
+            parts.push_back(trim(s.substr(start, i - start)));
+            start = i + len;
+            i += len - 1;
+        }
+    }
+    parts.push_back(trim(s.substr(start)));
+    return depth == 0;
+}
+
+// 's' is entirely enclosed in one pair of parentheses
+bool enclosed(const std::string& s) {
+    if (s.size() < 2 || s.front() != '(' || s.back() != ')')
+        return false;
+    int depth = 0;
+    for (size_t i = 0; i + 1 < s.size(); i++) {
+        if (s[i] == '(')
+            depth++;
+        else if (s[i] == ')')
+            depth--;
+        if (depth == 0)
+            return false;
+    }
+    return true;
+}
+
+std::string hex(uint64_t v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "0x%llxULL", static_cast<unsigned long long>(v));
+    return buf;
+}
+}  // namespace
+
+FPPFilter* FPPFilter::build(const FPPParser* parser, cstring spec) {
+    auto filter = new FPPFilter(parser);
+    if (!spec.isNullOrEmpty() && !filter->parse(spec))
+        return nullptr;
+    auto anno = parser->parserBlock->container->type->annotations->getSingle("filter");
+    if (anno != nullptr) {
+        auto str = anno->expr.size() == 1 ? anno->expr.at(0)->to<IR::StringLiteral>() : nullptr;
+        if (str == nullptr) {
+            ::error("%1%: expected a string literal", anno);
+            return nullptr;
+        }
+        if (!filter->parse(str->value))
+            return nullptr;
+    }
+    if (filter->clauses.empty())
+        return nullptr;
+    if (filter->clauses.size() > 64 || filter->members.size() > 64) {
+        ::error("filter: at most 64 clauses over 64 headers are supported");
+        return nullptr;
+    }
+    return filter;
+}
+
+bool FPPFilter::parse(cstring text) {
+    std::vector<std::string> conjuncts;
+    if (!split(text.c_str(), "&&", conjuncts)) {
+        ::error("filter %1%: unbalanced parentheses", text);
+        return false;
+    }
+    for (auto& c : conjuncts) {
+        std::string body = c;
+        while (enclosed(body))
+            body = trim(body.substr(1, body.size() - 2));
+        std::vector<std::string> disjuncts;
+        split(body, "||", disjuncts);
+        if (disjuncts.size() > 1 && conjuncts.size() > 1 && !enclosed(c)) {
+            ::error("filter %1%: put each disjunction in parentheses", text);
+            return false;
+        }
+
+        Clause clause;
+        for (auto& d : disjuncts) {
+            Atom atom;
+            if (!parseAtom(d, atom)) {
+                ::error("filter %1%: cannot parse '%2%'", text, d);
+                return false;
+            }
+            if (std::find(clause.members.begin(), clause.members.end(), atom.member) ==
+                clause.members.end())
+                clause.members.push_back(atom.member);
+            if (!uses(atom.member))
+                members.push_back(atom.member);
+            clause.atoms.push_back(atom);
+        }
+        clauses.push_back(clause);
+    }
+    return true;
+}
+
+// member, !member or member.field op value
+bool FPPFilter::parseAtom(const std::string& text, Atom& atom) const {
+    static const char* ops[] = { "==", "!=", "<=", ">=", "<", ">" };
+    size_t pos = std::string::npos;
+    for (auto op : ops) {
+        pos = text.find(op);
+        if (pos != std::string::npos) {
+            atom.op = op;
+            break;
+        }
+    }
+
+    std::string lhs = trim(text.substr(0, pos));
+    atom.negated = false;
+    if (pos == std::string::npos && !lhs.empty() && lhs[0] == '!') {
+        atom.negated = true;
+        lhs = trim(lhs.substr(1));
+    }
+    size_t dot = lhs.find('.');
+    atom.member = lhs.substr(0, dot);
+
+    auto type = parser->typeMap->getType(parser->headers, true)->to<IR::Type_StructLike>();
+    auto member = type == nullptr ? nullptr : type->getField(atom.member);
+    auto ht = member == nullptr ? nullptr :
+            parser->typeMap->getTypeType(member->type, true)->to<IR::Type_Header>();
+    if (ht == nullptr) {
+        ::error("filter: %1% is not a header member of %2%", atom.member, parser->headers->name);
+        return false;
+    }
+
+    atom.field = nullptr;
+    if (pos == std::string::npos)
+        return dot == std::string::npos;
+    if (dot == std::string::npos)
+        return false;
+    atom.field = ht->getField(lhs.substr(dot + 1));
+    if (atom.field == nullptr || atom.field->type->is<IR::Type_Varbits>()) {
+        ::error("filter: %1% has no fixed-width field %2%", ht->name, lhs.substr(dot + 1));
+        return false;
+    }
+    unsigned width = atom.field->type->width_bits();
+    if (width > 32 && (width % 8 != 0 || (atom.op != "==" && atom.op != "!="))) {
+        ::error("filter: %1% can only be compared for equality", lhs);
+        return false;
+    }
+    return parseValue(trim(text.substr(pos + atom.op.size())), width, atom);
+}
+
+// A number, an IPv4 or IPv6 address, optionally followed by /prefix.
+bool FPPFilter::parseValue(const std::string& text, unsigned width, Atom& atom) const {
+    unsigned bytes = (width + 7) / 8;
+    std::string number = text;
+    unsigned prefix = width;
+    size_t slash = text.find('/');
+    if (slash != std::string::npos) {
+        number = trim(text.substr(0, slash));
+        char* end;
+        prefix = strtoul(text.c_str() + slash + 1, &end, 10);
+        if (*end != '\0' || prefix > width || (atom.op != "==" && atom.op != "!="))
+            return false;
+    }
+
+    atom.value.assign(bytes, 0);
+    if (number.find(':') != std::string::npos || number.find('.') != std::string::npos) {
+        uint8_t addr[16];
+        bool v6 = number.find(':') != std::string::npos;
+        if ((v6 ? 128u : 32u) != width ||
+            inet_pton(v6 ? AF_INET6 : AF_INET, number.c_str(), addr) != 1)
+            return false;
+        std::copy(addr, addr + bytes, atom.value.begin());
+    } else if (number.compare(0, 2, "0x") == 0 || number.compare(0, 2, "0X") == 0) {
+        // hex digits fill the value from the last byte
+        std::string digits = number.substr(2);
+        if (digits.empty() || digits.size() > 2 * bytes ||
+            digits.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+            return false;
+        for (size_t i = 0; i < digits.size(); i++) {
+            unsigned nibble = std::stoul(digits.substr(digits.size() - 1 - i, 1), nullptr, 16);
+            atom.value[bytes - 1 - i / 2] |= nibble << (4 * (i % 2));
+        }
+    } else {
+        char* end;
+        errno = 0;
+        unsigned long long v = strtoull(number.c_str(), &end, 10);
+        if (number.empty() || *end != '\0' || errno != 0)
+            return false;
+        for (unsigned i = 0; i < bytes && i < 8; i++, v >>= 8)
+            atom.value[bytes - 1 - i] = v & 0xff;
+        if (v != 0)
+            return false;
+    }
+    if (width % 8 != 0 && atom.value[0] >> (width % 8) != 0)
+        return false;
+
+    // the first 'prefix' of the 'width' bits
+    atom.mask.assign(bytes, 0);
+    for (unsigned i = 0; i < prefix; i++) {
+        unsigned p = width - 1 - i;
+        atom.mask[bytes - 1 - p / 8] |= 1 << (p % 8);
+    }
+    for (unsigned i = 0; i < bytes; i++)
+        atom.value[i] &= atom.mask[i];
+    return true;
+}
+
+bool FPPFilter::uses(cstring member) const {
+    return std::find(members.begin(), members.end(), member) != members.end();
+}
+
+unsigned FPPFilter::bit(cstring member) const {
+    return std::find(members.begin(), members.end(), member) - members.begin();
+}
+
+void FPPFilter::emitLocals(CodeBuilder* builder) const {
+    auto program = parser->program;
+    builder->emitIndent();
+    if (program->resuming)
+        builder->appendFormat("uint64_t %s = cont->filterSeen, %s = cont->filterMatched",
+                              program->filterSeenVar.c_str(), program->filterMatchedVar.c_str());
+    else
+        builder->appendFormat("uint64_t %s = 0, %s = 0", program->filterSeenVar.c_str(),
+                              program->filterMatchedVar.c_str());
+    builder->endOfStatement(true);
+}
+
+void FPPFilter::emitCondition(CodeBuilder* builder, const Atom& atom, cstring object) const {
+    cstring field = atom.field->name.name;
+    unsigned width = atom.field->type->width_bits();
+    if (width <= 32) {
+        uint64_t value = 0, mask = 0;
+        for (unsigned i = 0; i < atom.value.size(); i++) {
+            value = value << 8 | atom.value[i];
+            mask = mask << 8 | atom.mask[i];
+        }
+        if (mask == (1ULL << width) - 1)
+            builder->appendFormat("%s->%s %s %s", object.c_str(), field.c_str(),
+                                  atom.op.c_str(), hex(value).c_str());
+        else
+            builder->appendFormat("(%s->%s & %s) %s %s", object.c_str(), field.c_str(),
+                                  hex(mask).c_str(), atom.op.c_str(), hex(value).c_str());
+        return;
+    }
+
+    // byte array in network order
+    builder->append(atom.op == "!=" ? "!(1" : "(1");
+    for (unsigned i = 0; i < atom.value.size(); i++) {
+        if (atom.mask[i] == 0)
+            continue;
+        if (atom.mask[i] == 0xff)
+            builder->appendFormat(" && %s->%s[%u] == 0x%02x", object.c_str(), field.c_str(), i,
+                                  atom.value[i]);
+        else
+            builder->appendFormat(" && (%s->%s[%u] & 0x%02x) == 0x%02x", object.c_str(),
+                                  field.c_str(), i, atom.mask[i], atom.value[i]);
+    }
+    builder->append(")");
+}
+
+void FPPFilter::emitExtracted(CodeBuilder* builder, cstring member, cstring object) const {
+    if (!uses(member))
+        return;
+    auto program = parser->program;
+    cstring seen = program->filterSeenVar;
+    cstring matched = program->filterMatchedVar;
+    std::string mbit = hex(1ULL << bit(member));
+
+    builder->emitIndent();
+    builder->appendFormat("if (!(%s & %s)) ", seen.c_str(), mbit.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("%s |= %s", seen.c_str(), mbit.c_str());
+    builder->endOfStatement(true);
+    for (unsigned c = 0; c < clauses.size(); c++) {
+        std::string cbit = hex(1ULL << c);
+        for (auto& atom : clauses[c].atoms) {
+            if (atom.member != member || atom.negated)
+                continue;
+            builder->emitIndent();
+            if (atom.field == nullptr) {
+                builder->appendFormat("%s |= %s", matched.c_str(), cbit.c_str());
+            } else {
+                builder->append("if (");
+                emitCondition(builder, atom, object);
+                builder->appendFormat(") %s |= %s", matched.c_str(), cbit.c_str());
+            }
+            builder->endOfStatement(true);
+        }
+    }
+
+    // A clause is decided once all of its members have been extracted.
+    for (unsigned c = 0; c < clauses.size(); c++) {
+        auto& members = clauses[c].members;
+        if (std::find(members.begin(), members.end(), member) == members.end())
+            continue;
+        uint64_t mask = 0;
+        for (auto m : members)
+            mask |= 1ULL << bit(m);
+        builder->emitIndent();
+        builder->append("if (");
+        if (members.size() > 1)
+            builder->appendFormat("(%s & %s) == %s && ", seen.c_str(), hex(mask).c_str(),
+                                  hex(mask).c_str());
+        builder->appendFormat("!(%s & %s)) goto %s;", matched.c_str(), hex(1ULL << c).c_str(),
+                              program->filteredLabel.c_str());
+        builder->newline();
+    }
+    builder->blockEnd(true);
+}
+
+void FPPFilter::emitAccept(CodeBuilder* builder) const {
+    auto program = parser->program;
+    cstring seen = program->filterSeenVar;
+    cstring matched = program->filterMatchedVar;
+    for (unsigned c = 0; c < clauses.size(); c++) {
+        for (auto& atom : clauses[c].atoms) {
+            if (!atom.negated)
+                continue;
+            builder->emitIndent();
+            builder->appendFormat("if (!(%s & %s)) %s |= %s;", seen.c_str(),
+                                  hex(1ULL << bit(atom.member)).c_str(), matched.c_str(),
+                                  hex(1ULL << c).c_str());
+            builder->newline();
+        }
+    }
+    uint64_t all = clauses.size() == 64 ? ~0ULL : (1ULL << clauses.size()) - 1;
+    builder->emitIndent();
+    builder->appendFormat("if (%s != %s) goto %s;", matched.c_str(), hex(all).c_str(),
+                          program->filteredLabel.c_str());
+    builder->newline();
+}
+
+}  // namespace FPP
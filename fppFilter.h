@@ -0,0 +1,77 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPFILTER_H_
+#define _BACKENDS_FPP_FPPFILTER_H_
+
+#include <vector>
+
+#include "fppParser.h"
+
+namespace FPP {
+
+// Packet filter in conjunctive normal form over members of the headers
+// structure, e.g.
+//
+//     ipv4 && (!tcp || tcp.dstPort != 443) && ipv4.srcAddr == 10.0.0.0/8
+//
+// Atoms refer to the first extraction of a member; a field of a member
+// that is not extracted compares false. Each clause is decided as soon as
+// all members it refers to are extracted, clauses with a '!member' atom
+// only at accept; a false clause ends parsing with Filtered.
+class FPPFilter {
+ public:
+    struct Atom {
+        cstring member;
+        const IR::StructField* field;  // nullptr for a presence test
+        bool negated;  // presence tests only
+        cstring op;
+        std::vector<uint8_t> value;  // network order, width of the field
+        std::vector<uint8_t> mask;
+    };
+    struct Clause {
+        std::vector<Atom> atoms;
+        std::vector<cstring> members;
+    };
+
+    const FPPParser* parser;
+    std::vector<Clause> clauses;
+    // members referred to by any clause, a member's position is its bit
+    std::vector<cstring> members;
+
+    // Parses the --filter option and the @filter annotation of the
+    // parser; returns nullptr if there is neither or on error.
+    static FPPFilter* build(const FPPParser* parser, cstring spec);
+
+    bool uses(cstring member) const;
+    void emitLocals(CodeBuilder* builder) const;
+    // Evaluates the atoms on 'member' extracted into the structure
+    // pointed to by 'object'.
+    void emitExtracted(CodeBuilder* builder, cstring member, cstring object) const;
+    void emitAccept(CodeBuilder* builder) const;
+
+ private:
+    explicit FPPFilter(const FPPParser* parser) : parser(parser) {}
+    bool parse(cstring text);
+    bool parseAtom(const std::string& text, Atom& atom) const;
+    bool parseValue(const std::string& text, unsigned width, Atom& atom) const;
+    unsigned bit(cstring member) const;
+    void emitCondition(CodeBuilder* builder, const Atom& atom, cstring object) const;
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPFILTER_H_ */
@@ -0,0 +1,158 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "fppFlowKey.h"
+#include "fppModel.h"
+#include "fppType.h"
+
+namespace FPP {
+
+FPPFlowKey* FPPFlowKey::build(const IR::P4Program* program, cstring hash) {
+    auto key = new FPPFlowKey(hash);
+    for (auto d : program->objects) {
+        auto ht = d->to<IR::Type_Header>();
+        if (ht == nullptr)
+            continue;
+        for (auto f : ht->fields) {
+            if (f->annotations->getSingle("flow_key") == nullptr)
+                continue;
+            auto type = FPPTypeFactory::instance->create(f->type);
+            auto scalar = type == nullptr ? nullptr : type->to<FPPScalarType>();
+            if (scalar == nullptr) {
+                ::error("%1%: only bit<N> fields can be part of the flow key", f);
+                return nullptr;
+            }
+            key->fields.push_back({ ht->name.name, f, type });
+        }
+    }
+    return key->fields.empty() ? nullptr : key;
+}
+
+std::vector<const FPPFlowKey::Field*> FPPFlowKey::fieldsOf(cstring header) const {
+    std::vector<const Field*> result;
+    for (auto& f : fields) {
+        if (f.header == header)
+            result.push_back(&f);
+    }
+    return result;
+}
+
+void FPPFlowKey::emitTypes(CodeBuilder* builder) const {
+    builder->appendFormat("struct %s ", FPPModel::reserved("flow_key").c_str());
+    builder->blockStart();
+    for (auto& f : fields) {
+        builder->emitIndent();
+        f.type->declare(builder, f.member(), false);
+        builder->endOfStatement(true);
+    }
+    builder->blockEnd(false);
+    builder->append(" __attribute__((packed))");
+    builder->endOfStatement(true);
+    builder->newline();
+
+    builder->appendFormat("struct %s ", FPPModel::reserved("flow").c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("struct %s key", FPPModel::reserved("flow_key").c_str());
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->append("uint32_t hash");
+    builder->endOfStatement(true);
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+}
+
+// The symmetric Toeplitz key repeats 0x6d5a, so the 32-bit window of the
+// key for a bit depends only on the bit position modulo 16: a table per
+// byte parity gives the contribution of any key byte.
+void FPPFlowKey::emitHelpers(CodeBuilder* builder) const {
+    if (hash == "toeplitz") {
+        const uint64_t key = 0x6d5a6d5a6d5a6d5aULL;
+        builder->appendFormat("static const uint32_t %s[2][256] = ",
+                              FPPModel::reserved("toeplitz").c_str());
+        builder->blockStart();
+        for (unsigned parity = 0; parity < 2; parity++) {
+            builder->emitIndent();
+            builder->append("{");
+            builder->increaseIndent();
+            for (unsigned byte = 0; byte < 256; byte++) {
+                uint32_t value = 0;
+                for (unsigned bit = 0; bit < 8; bit++) {
+                    if (byte & (0x80 >> bit))
+                        value ^= static_cast<uint32_t>(key >> (32 - (parity * 8 + bit)));
+                }
+                if (byte % 8 == 0) {
+                    builder->newline();
+                    builder->emitIndent();
+                }
+                builder->appendFormat("0x%08x,", value);
+            }
+            builder->decreaseIndent();
+            builder->newline();
+            builder->emitIndent();
+            builder->append("},");
+            builder->newline();
+        }
+        builder->blockEnd(false);
+        builder->endOfStatement(true);
+        builder->newline();
+    }
+
+    // The hash covers the whole key, including the members of headers
+    // that were not extracted, so it is a function of the key alone.
+    builder->appendFormat("static uint32_t %s(const struct %s *key)",
+                          FPPModel::reserved("flow_hash").c_str(),
+                          FPPModel::reserved("flow_key").c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    const uint8_t *p = (const uint8_t *) key;");
+    if (hash == "crc32c") {
+        builder->appendLine("    uint32_t crc = 0xffffffff;");
+        builder->appendLine("    size_t len = sizeof(*key);");
+        builder->appendLine("#ifdef __SSE4_2__");
+        builder->appendLine("    for (; len >= 4; len -= 4, p += 4) {");
+        builder->appendLine("        uint32_t word;");
+        builder->appendLine("        memcpy(&word, p, 4);");
+        builder->appendLine("        crc = __builtin_ia32_crc32si(crc, word);");
+        builder->appendLine("    }");
+        builder->appendLine("    for (; len > 0; len--)");
+        builder->appendLine("        crc = __builtin_ia32_crc32qi(crc, *p++);");
+        builder->appendLine("#else");
+        builder->appendLine("    for (; len > 0; len--) {");
+        builder->appendLine("        crc ^= *p++;");
+        builder->appendLine("        for (int k = 0; k < 8; k++)");
+        builder->appendLine("            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));");
+        builder->appendLine("    }");
+        builder->appendLine("#endif");
+        builder->appendLine("    return crc;");
+    } else {
+        builder->appendLine("    uint32_t hash = 0;");
+        builder->appendLine("    for (size_t i = 0; i < sizeof(*key); i++)");
+        builder->appendFormat("        hash ^= %s[i & 1][p[i]];",
+                              FPPModel::reserved("toeplitz").c_str());
+        builder->newline();
+        builder->appendLine("    return hash;");
+    }
+    builder->blockEnd(true);
+}
+
+void FPPFlowKey::emitHash(CodeBuilder* builder, cstring var) const {
+    builder->appendFormat("%s->hash = %s(&%s->key);", var.c_str(),
+                          FPPModel::reserved("flow_hash").c_str(), var.c_str());
+}
+
+}  // namespace FPP
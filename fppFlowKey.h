@@ -0,0 +1,56 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPFLOWKEY_H_
+#define _BACKENDS_FPP_FPPFLOWKEY_H_
+
+#include "ir/ir.h"
+#include "fppObject.h"
+
+namespace FPP {
+
+class FPPType;
+
+// Flow key built from the header fields annotated with @flow_key. The key
+// is a packed structure with a member per annotated field; the parser
+// fills a member when it extracts the header and hashes the whole
+// structure when it returns, so equal keys always get equal hashes.
+class FPPFlowKey {
+ public:
+    struct Field {
+        cstring header;  // name of the header type
+        const IR::StructField* field;
+        FPPType* type;
+        cstring member() const { return header + "_" + field->name.name; }
+    };
+
+    cstring hash;  // "crc32c" or "toeplitz"
+    std::vector<Field> fields;
+
+    explicit FPPFlowKey(cstring hash) : hash(hash) {}
+    // Returns nullptr if no field is annotated.
+    static FPPFlowKey* build(const IR::P4Program* program, cstring hash);
+
+    std::vector<const Field*> fieldsOf(cstring header) const;
+    void emitTypes(CodeBuilder* builder) const;
+    void emitHelpers(CodeBuilder* builder) const;
+    // Emits the statement storing the hash of the key of 'var'.
+    void emitHash(CodeBuilder* builder, cstring var) const;
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPFLOWKEY_H_ */
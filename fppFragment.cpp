@@ -0,0 +1,338 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "fppFragment.h"
+#include "fppModel.h"
+#include "fppProgram.h"
+
+namespace FPP {
+
+cstring FPPFragment::kind(const IR::Type_Header* type) {
+    auto anno = type->annotations->getSingle("fragment");
+    if (anno == nullptr)
+        return nullptr;
+    auto str = anno->expr.size() == 1 ? anno->expr.at(0)->to<IR::StringLiteral>() : nullptr;
+    if (str == nullptr || (str->value != "ipv4" && str->value != "ipv6" &&
+                           str->value != "ipv6_frag")) {
+        ::error("%1%: expected @fragment(\"ipv4\"), (\"ipv6\") or (\"ipv6_frag\")", anno);
+        return nullptr;
+    }
+    return str->value;
+}
+
+bool FPPFragment::flagged(const IR::Type_Header* type) {
+    auto k = kind(type);
+    return k != nullptr && k != "ipv6";
+}
+
+std::set<cstring> FPPFragment::kinds(const IR::P4Program* program) {
+    std::set<cstring> result;
+    for (auto d : program->objects) {
+        if (auto ht = d->to<IR::Type_Header>()) {
+            auto k = kind(ht);
+            if (k != nullptr)
+                result.insert(k);
+        }
+    }
+    return result;
+}
+
+// IPv4 has the flags and the offset in bytes 6 and 7, the IPv6 fragment
+// header the offset and the M flag in bytes 2 and 3.
+void FPPFragment::emitCheck(CodeBuilder* builder, cstring kind, cstring object, cstring start,
+                            cstring label) {
+    cstring var = FPPModel::reserved("fragment");
+    builder->emitIndent();
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("const uint8_t *%s = %s", var.c_str(), start.c_str());
+    builder->endOfStatement(true);
+    unsigned byte = kind == "ipv4" ? 6 : 2;
+    unsigned flag = kind == "ipv4" ? 0x3f : 0xff;
+    unsigned offset = kind == "ipv4" ? 0x1f : 0xff;
+    unsigned low = kind == "ipv4" ? 0xff : 0xf9;
+    builder->emitIndent();
+    builder->appendFormat("%s.fragmented = ((%s[%u] & 0x%02x) | (%s[%u] & 0x%02x)) != 0",
+                          object.c_str(), var.c_str(), byte, flag, var.c_str(), byte + 1, low);
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("if (((%s[%u] & 0x%02x) | (%s[%u] & 0x%02x)) != 0) goto %s;",
+                          var.c_str(), byte, offset, var.c_str(), byte + 1,
+                          kind == "ipv4" ? 0xff : 0xf8, label.c_str());
+    builder->newline();
+    builder->blockEnd(true);
+}
+
+// The keys are scanned without touching the buffers. An entry expires
+// 'timeout' after its first fragment; a new datagram takes a free or
+// expired entry, or else evicts the entry expiring first.
+void FPPFragment::emitTypes(CodeBuilder* builder, const FPPProgram* program, unsigned entries) {
+    cstring entryCount = FPPModel::macro("FPP_REASSEMBLY_ENTRIES");
+    cstring bytes = FPPModel::macro("FPP_REASSEMBLY_BYTES");
+    cstring headroom = FPPModel::macro("FPP_REASSEMBLY_HEAD");
+    builder->appendFormat("#define %s %u", entryCount.c_str(), entries);
+    builder->newline();
+    builder->appendFormat("#ifndef %s", bytes.c_str());
+    builder->newline();
+    builder->appendFormat("#define %s 9216", bytes.c_str());
+    builder->newline();
+    builder->appendLine("#endif");
+    builder->appendFormat("#ifndef %s", headroom.c_str());
+    builder->newline();
+    builder->appendFormat("#define %s 128", headroom.c_str());
+    builder->newline();
+    builder->appendLine("#endif");
+    builder->newline();
+
+    builder->appendFormat("struct %s ", FPPModel::reserved("fragment_key").c_str());
+    builder->blockStart();
+    builder->appendLine("    /* source, destination, identification, protocol and version */");
+    builder->appendLine("    uint8_t key[40];");
+    builder->appendLine("    /* 0 if the entry is free */");
+    builder->appendLine("    uint64_t expires;");
+    builder->appendLine("    /* payload length, 0 until the last fragment */");
+    builder->appendLine("    uint32_t length;");
+    builder->appendLine("    /* bytes of the network headers, 0 until the first fragment */");
+    builder->appendLine("    uint16_t head;");
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+
+    builder->appendFormat("struct %s ", FPPModel::reserved("fragment_buffer").c_str());
+    builder->blockStart();
+    builder->appendFormat("    uint64_t seen[(%s / 8 + 63) / 64];", bytes.c_str());
+    builder->newline();
+    builder->appendFormat("    uint8_t data[%s + %s];", headroom.c_str(), bytes.c_str());
+    builder->newline();
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+
+    builder->appendFormat("struct %s ", program->reassemblyType.c_str());
+    builder->blockStart();
+    builder->appendLine("    uint64_t timeout;");
+    builder->appendFormat("    struct %s keys[%s];",
+                          FPPModel::reserved("fragment_key").c_str(), entryCount.c_str());
+    builder->newline();
+    builder->appendFormat("    struct %s buffers[%s];",
+                          FPPModel::reserved("fragment_buffer").c_str(), entryCount.c_str());
+    builder->newline();
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+
+    builder->appendFormat("void %s(struct %s *table, uint64_t timeout);",
+                          FPPModel::reserved("reassembly_init").c_str(),
+                          program->reassemblyType.c_str());
+    builder->newline();
+    builder->appendFormat("const uint8_t *%s(struct %s *table, const uint8_t *packet, "
+                          "uint32_t packet_len, const %s *list, uint64_t now, uint32_t *len);",
+                          program->reassembleFunction.c_str(), program->reassemblyType.c_str(),
+                          program->headerListType.c_str());
+    builder->newline();
+}
+
+// The payload is stored at its offset after FPP_REASSEMBLY_HEAD bytes and
+// the network headers of the first fragment right before it, so the
+// datagram is contiguous without moving the payload. The headers are
+// fixed up to describe an unfragmented datagram; an IPv6 datagram keeps
+// its fragment header with offset 0 and no M flag.
+void FPPFragment::emitReassembly(CodeBuilder* builder, const FPPProgram* program) {
+    cstring entryCount = FPPModel::macro("FPP_REASSEMBLY_ENTRIES");
+    cstring bytes = FPPModel::macro("FPP_REASSEMBLY_BYTES");
+    cstring headroom = FPPModel::macro("FPP_REASSEMBLY_HEAD");
+    builder->appendFormat("void %s(struct %s *table, uint64_t timeout)",
+                          FPPModel::reserved("reassembly_init").c_str(),
+                          program->reassemblyType.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    memset(table->keys, 0, sizeof(table->keys));");
+    builder->appendLine("    table->timeout = timeout;");
+    builder->blockEnd(true);
+    builder->newline();
+
+    builder->appendFormat("const uint8_t *%s(struct %s *table, const uint8_t *packet, "
+                          "uint32_t packet_len, const %s *list, uint64_t now, uint32_t *len)",
+                          program->reassembleFunction.c_str(), program->reassemblyType.c_str(),
+                          program->headerListType.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    uint32_t l3 = 0, base = 0, frag = 0, version = 0;");
+    builder->appendLine("    for (; list != NULL; list = list->next) {");
+    builder->appendLine("        switch (list->type) {");
+    for (auto d : program->program->objects) {
+        auto ht = d->to<IR::Type_Header>();
+        auto k = ht != nullptr ? kind(ht) : cstring();
+        if (k.isNullOrEmpty())
+            continue;
+        cstring hdr = cstring("((const struct ") + FPPModel::global(ht->name.name) +
+                      " *) list->hdr)";
+        builder->appendFormat("        case %s:", FPPModel::reserved(ht->name.name).c_str());
+        builder->newline();
+        if (k == "ipv6") {
+            builder->appendFormat("            base = %s->header_offset;", hdr.c_str());
+            builder->newline();
+        } else {
+            builder->appendFormat("            if (%s->fragmented) {", hdr.c_str());
+            builder->newline();
+            if (k == "ipv4") {
+                builder->appendLine("                version = 4;");
+                builder->appendFormat("                l3 = %s->header_offset;", hdr.c_str());
+            } else {
+                builder->appendLine("                version = 6;");
+                builder->appendFormat("                l3 = base, frag = %s->header_offset;",
+                                      hdr.c_str());
+            }
+            builder->newline();
+            builder->appendLine("            }");
+        }
+        builder->appendLine("            break;");
+    }
+    builder->appendLine("        default:");
+    builder->appendLine("            break;");
+    builder->appendLine("        }");
+    builder->appendLine("    }");
+    builder->newline();
+    builder->appendLine("    uint8_t key[40] = { 0 };");
+    builder->appendLine("    uint32_t head, offset, length, more;");
+    builder->appendLine("    const uint8_t *p = packet + l3;");
+    builder->appendLine("    if (version == 4) {");
+    builder->appendLine("        uint32_t total = (uint32_t) p[2] << 8 | p[3];");
+    builder->appendLine("        head = (p[0] & 0x0f) * 4;");
+    builder->appendLine("        if (head < 20 || total < head || l3 + total > packet_len)");
+    builder->appendLine("            return NULL;");
+    builder->appendLine("        memcpy(key, p + 12, 4);");
+    builder->appendLine("        memcpy(key + 16, p + 16, 4);");
+    builder->appendLine("        memcpy(key + 32, p + 4, 2);");
+    builder->appendLine("        key[38] = p[9];");
+    builder->appendLine("        offset = ((uint32_t) (p[6] & 0x1f) << 8 | p[7]) * 8;");
+    builder->appendLine("        more = p[6] & 0x20;");
+    builder->appendLine("        length = total - head;");
+    builder->appendLine("    } else if (version == 6) {");
+    builder->appendLine("        const uint8_t *f = packet + frag;");
+    builder->appendLine("        uint32_t end = l3 + 40 + ((uint32_t) p[4] << 8 | p[5]);");
+    builder->appendLine("        if (frag < l3 + 40 || end < frag + 8 || end > packet_len)");
+    builder->appendLine("            return NULL;");
+    builder->appendLine("        head = frag + 8 - l3;");
+    builder->appendLine("        memcpy(key, p + 8, 32);");
+    builder->appendLine("        memcpy(key + 32, f + 4, 4);");
+    builder->appendLine("        key[38] = f[0];");
+    builder->appendLine("        offset = ((uint32_t) f[2] << 8 | f[3]) & 0xfff8;");
+    builder->appendLine("        more = f[3] & 1;");
+    builder->appendLine("        length = end - frag - 8;");
+    builder->appendLine("    } else {");
+    builder->appendLine("        return NULL;");
+    builder->appendLine("    }");
+    builder->appendLine("    key[39] = (uint8_t) version;");
+    builder->appendLine("    /* all fragments but the last carry multiples of 8 bytes */");
+    builder->appendFormat("    if (head > %s || offset + length > %s ||",
+                          headroom.c_str(), bytes.c_str());
+    builder->newline();
+    builder->appendLine("        (more && (length == 0 || length % 8 != 0)))");
+    builder->appendLine("        return NULL;");
+    builder->newline();
+
+    cstring keyType = FPPModel::reserved("fragment_key");
+    cstring bufferType = FPPModel::reserved("fragment_buffer");
+    builder->appendFormat("    struct %s *e = NULL, *victim = &table->keys[0];", keyType.c_str());
+    builder->newline();
+    builder->appendFormat("    for (uint32_t i = 0; i < %s; i++) {", entryCount.c_str());
+    builder->newline();
+    builder->appendFormat("        struct %s *k = &table->keys[i];", keyType.c_str());
+    builder->newline();
+    builder->appendLine("        if (k->expires > now && memcmp(k->key, key, sizeof(key)) == 0) {");
+    builder->appendLine("            e = k;");
+    builder->appendLine("            break;");
+    builder->appendLine("        }");
+    builder->appendLine("        if (k->expires < victim->expires)");
+    builder->appendLine("            victim = k;");
+    builder->appendLine("    }");
+    builder->appendFormat("    struct %s *b;", bufferType.c_str());
+    builder->newline();
+    builder->appendLine("    if (e == NULL) {");
+    builder->appendLine("        e = victim;");
+    builder->appendLine("        memcpy(e->key, key, sizeof(key));");
+    builder->appendLine("        e->expires = now + table->timeout;");
+    builder->appendLine("        e->length = e->head = 0;");
+    builder->appendLine("        b = &table->buffers[e - table->keys];");
+    builder->appendLine("        memset(b->seen, 0, sizeof(b->seen));");
+    builder->appendLine("    } else {");
+    builder->appendLine("        b = &table->buffers[e - table->keys];");
+    builder->appendLine("    }");
+    builder->newline();
+    builder->appendLine("    if (!more) {");
+    builder->appendLine("        if (e->length != 0 && e->length != offset + length) {");
+    builder->appendLine("            e->expires = 0;");
+    builder->appendLine("            return NULL;");
+    builder->appendLine("        }");
+    builder->appendLine("        e->length = offset + length;");
+    builder->appendLine("    }");
+    builder->appendLine("    /* data past the end would never be returned but could fill a hole */");
+    builder->appendLine("    if (e->length != 0 && offset + length > e->length)");
+    builder->appendLine("        return NULL;");
+    builder->appendLine("    if (offset == 0) {");
+    builder->appendFormat("        memcpy(b->data + %s - head, p, head);", headroom.c_str());
+    builder->newline();
+    builder->appendLine("        e->head = (uint16_t) head;");
+    builder->appendLine("    }");
+    builder->appendFormat("    memcpy(b->data + %s + offset, p + head, length);", headroom.c_str());
+    builder->newline();
+    builder->appendLine("    for (uint32_t i = offset / 8; i < (offset + length + 7) / 8; i++)");
+    builder->appendLine("        b->seen[i / 64] |= 1ULL << (i % 64);");
+    builder->appendLine("    if (e->head == 0 || e->length == 0)");
+    builder->appendLine("        return NULL;");
+    builder->appendLine("    /* complete once every block below the length was received; blocks");
+    builder->appendLine("       past it, recorded before the last fragment, are ignored */");
+    builder->appendLine("    uint32_t blocks = (e->length + 7) / 8;");
+    builder->appendLine("    for (uint32_t i = 0; i < blocks / 64; i++) {");
+    builder->appendLine("        if (b->seen[i] != ~0ULL)");
+    builder->appendLine("            return NULL;");
+    builder->appendLine("    }");
+    builder->appendLine("    if (blocks % 64 != 0 &&");
+    builder->appendLine("        (~b->seen[blocks / 64] & ((1ULL << (blocks % 64)) - 1)) != 0)");
+    builder->appendLine("        return NULL;");
+    builder->newline();
+
+    builder->appendFormat("    uint8_t *d = b->data + %s - e->head;", headroom.c_str());
+    builder->newline();
+    builder->appendLine("    uint32_t total = e->head + e->length;");
+    builder->appendLine("    e->expires = 0;");
+    builder->appendLine("    if (total - (version == 4 ? 0 : 40) > 0xffff)");
+    builder->appendLine("        return NULL;");
+    builder->appendLine("    if (version == 4) {");
+    builder->appendLine("        uint32_t sum = 0;");
+    builder->appendLine("        d[2] = (uint8_t) (total >> 8);");
+    builder->appendLine("        d[3] = (uint8_t) total;");
+    builder->appendLine("        d[6] &= 0x40;");
+    builder->appendLine("        d[7] = d[10] = d[11] = 0;");
+    builder->appendLine("        for (uint32_t i = 0; i < e->head; i += 2)");
+    builder->appendLine("            sum += (uint32_t) d[i] << 8 | d[i + 1];");
+    builder->appendLine("        while (sum >> 16)");
+    builder->appendLine("            sum = (sum & 0xffff) + (sum >> 16);");
+    builder->appendLine("        d[10] = (uint8_t) (~sum >> 8);");
+    builder->appendLine("        d[11] = (uint8_t) ~sum;");
+    builder->appendLine("    } else {");
+    builder->appendLine("        d[4] = (uint8_t) ((total - 40) >> 8);");
+    builder->appendLine("        d[5] = (uint8_t) (total - 40);");
+    builder->appendLine("        d[e->head - 6] = 0;");
+    builder->appendLine("        d[e->head - 5] &= 0x06;");
+    builder->appendLine("    }");
+    builder->appendLine("    *len = total;");
+    builder->appendLine("    return d;");
+    builder->blockEnd(true);
+}
+
+}  // namespace FPP
@@ -0,0 +1,53 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef _BACKENDS_FPP_FPPFRAGMENT_H_
+#define _BACKENDS_FPP_FPPFRAGMENT_H_
+
+#include <set>
+
+#include "ir/ir.h"
+#include "fppObject.h"
+
+namespace FPP {
+
+class FPPProgram;
+
+// Fragments of headers annotated with @fragment("ipv4") or
+// @fragment("ipv6_frag"), the IPv6 fragment extension header. Their
+// structures get a fragmented member, and a packet that is not the first
+// fragment ends parsing with Fragmented before the transport headers. A
+// header annotated with @fragment("ipv6") provides the addresses of the
+// IPv6 fragments to the reassembly.
+class FPPFragment {
+ public:
+    // Kind of a header, nullptr if it is not annotated.
+    static cstring kind(const IR::Type_Header* type);
+    // The header structure has a fragmented member.
+    static bool flagged(const IR::Type_Header* type);
+    // Kinds used by the headers of the program.
+    static std::set<cstring> kinds(const IR::P4Program* program);
+    // Sets the fragmented member of 'object' starting at 'start' and jumps
+    // to 'label' if the packet is not the first fragment.
+    static void emitCheck(CodeBuilder* builder, cstring kind, cstring object, cstring start,
+                          cstring label);
+    // The fragment table with 'entries' datagrams and its functions.
+    static void emitTypes(CodeBuilder* builder, const FPPProgram* program, unsigned entries);
+    static void emitReassembly(CodeBuilder* builder, const FPPProgram* program);
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPFRAGMENT_H_ */
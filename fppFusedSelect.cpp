@@ -0,0 +1,215 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+
+#include "lib/stringify.h"
+#include "fppFusedSelect.h"
+#include "fppProgram.h"
+
+namespace FPP {
+
+// Width of the select key, or 0 if the select cannot take part in a table.
+unsigned FPPFusedSelect::keyWidth(const FPPParserState* ps) {
+    auto se = ps->state->selectExpression;
+    if (se == nullptr || !se->is<IR::SelectExpression>())
+        return 0;
+    auto select = se->to<IR::SelectExpression>()->select;
+    if (select->components.size() != 1)
+        return 0;
+
+    for (auto t : ps->transitions) {
+        if (!t->isDefault() && !t->selectCase->keyset->is<IR::Constant>())
+            return 0;
+    }
+
+    auto type = ps->parser->typeMap->getType(select->components.at(0), true);
+    if (type->is<IR::Type_Boolean>())
+        return 1;
+    auto tb = type->to<IR::Type_Bits>();
+    if (tb == nullptr || tb->isSigned || tb->size > 32)
+        return 0;
+    return tb->size;
+}
+
+// Numbers the distinct targets of a state; cases leading to the same
+// target share a class, so the class needs far fewer bits than the key.
+void FPPFusedSelect::classify(const FPPParserState* ps, Node& node) {
+    auto classOf = [&node](cstring to) {
+        auto it = std::find(node.targets.begin(), node.targets.end(), to);
+        if (it != node.targets.end())
+            return static_cast<unsigned>(it - node.targets.begin());
+        node.targets.push_back(to);
+        return static_cast<unsigned>(node.targets.size() - 1);
+    };
+
+    node.defaultClass = 0;
+    for (auto t : ps->transitions) {
+        if (t->isDefault()) {
+            node.defaultClass = classOf(t->to);
+            break;
+        }
+        auto value = t->selectCase->keyset->to<IR::Constant>()->asUnsigned();
+        node.cases.emplace_back(value, classOf(t->to));
+    }
+
+    node.bits = 0;
+    while ((1u << node.bits) < node.targets.size())
+        node.bits++;
+    node.children.assign(node.targets.size(), -1);
+}
+
+bool FPPFusedSelect::onPath(int node, const FPPParserState* ps) const {
+    for (; node >= 0; node = nodes[node].parent) {
+        if (nodes[node].state == ps)
+            return true;
+    }
+    return false;
+}
+
+// Adds a successor of 'parent' as a fused node if its extracts and key
+// are at static offsets and its class fits in the remaining bits.
+bool FPPFusedSelect::addNode(int parent, const FPPParserState* ps, unsigned maxBits) {
+    if (ps == nullptr || ps->state->isBuiltin() || nodes[parent].offsets.dynamic ||
+        onPath(parent, ps))
+        return false;
+
+    Node node;
+    node.state = ps;
+    node.parent = parent;
+    node.offset = nodes[parent].offsets.offset;
+    node.offsets = nodes[parent].offsets;
+    node.keyOffset = node.keyWidth = 0;
+    node.keyMask = 0;
+    // The skipped states run without bounds checks once the span is verified.
+    if (!node.offsets.simulate(ps))
+        return false;
+
+    auto se = ps->state->selectExpression;
+    if (se != nullptr && se->is<IR::SelectExpression>()) {
+        if (keyWidth(ps) == 0)
+            return false;
+        auto key = se->to<IR::SelectExpression>()->select->components.at(0);
+        uint64_t keyMask;
+        if (!node.offsets.keyBits(key, node.keyOffset, node.keyWidth, keyMask))
+            return false;
+        node.keyMask = static_cast<uint32_t>(keyMask);
+    }
+    classify(ps, node);
+    if (bits + node.bits > maxBits)
+        return false;
+
+    bits += node.bits;
+    span = std::max(span, std::max(node.offsets.offset, node.keyOffset + node.keyWidth));
+    nodes.push_back(node);
+    return true;
+}
+
+FPPFusedSelect* FPPFusedSelect::build(const FPPParserState* state, unsigned maxBits) {
+    unsigned width = keyWidth(state);
+    if (width == 0)
+        return nullptr;
+
+    auto result = new FPPFusedSelect(state);
+    Node root;
+    root.state = state;
+    root.parent = -1;
+    root.offset = 0;
+    root.offsets = FPPStaticOffsets(state->parser);
+    root.keyOffset = 0;
+    root.keyWidth = width;
+    root.keyMask = static_cast<uint32_t>(FPPStaticOffsets::widthMask(width));
+    classify(state, root);
+    if (root.bits > maxBits)
+        return nullptr;
+    result->bits = root.bits;
+    result->nodes.push_back(root);
+
+    // Breadth first, so that the budget goes to the nearest states.
+    for (size_t i = 0; i < result->nodes.size(); i++) {
+        for (size_t c = 0; c < result->nodes[i].targets.size(); c++) {
+            auto succ = state->parser->getState(result->nodes[i].targets[c]);
+            if (result->addNode(i, succ, maxBits))
+                result->nodes[i].children[c] = result->nodes.size() - 1;
+        }
+    }
+    if (result->nodes.size() < 2)
+        return nullptr;
+
+    // The first class occupies the most significant bits of the index.
+    unsigned shift = result->bits;
+    for (auto& node : result->nodes) {
+        shift -= node.bits;
+        node.shift = shift;
+    }
+
+    for (unsigned index = 0; index < (1u << result->bits); index++) {
+        size_t stub = result->evaluate(index);
+        if (stub > 255)
+            return nullptr;
+        result->table.push_back(stub);
+    }
+    return result;
+}
+
+// Follows the classes of an index from the first state; returns the stub
+// of the resulting path.
+size_t FPPFusedSelect::evaluate(unsigned index) {
+    Stub path;
+    int n = 0;
+    while (true) {
+        auto& node = nodes[n];
+        unsigned cls = (index >> node.shift) & FPPStaticOffsets::widthMask(node.bits);
+        if (cls >= node.targets.size())
+            cls = node.defaultClass;
+        if (node.children[cls] < 0) {
+            path.target = node.targets[cls];
+            break;
+        }
+        n = node.children[cls];
+        path.path.push_back(n);
+    }
+
+    for (size_t i = 0; i < stubs.size(); i++) {
+        if (stubs[i].path == path.path && stubs[i].target == path.target)
+            return i;
+    }
+    stubs.push_back(path);
+    return stubs.size() - 1;
+}
+
+cstring FPPFusedSelect::stubLabel(size_t stub) const {
+    return FPPModel::reserved(state->state->name.name + "_fused" +
+                              Util::toString(static_cast<unsigned>(stub)));
+}
+
+// Reads 'width' bits at an arbitrary bit offset in network order.
+void FPPFusedSelect::emitHelpers(CodeBuilder* builder) {
+    builder->appendFormat("static inline uint32_t %s(const uint8_t *packet, uint64_t bit, "
+                          "unsigned width)", FPPModel::reserved("fused_key").c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    const uint8_t *p = packet + bit / 8;");
+    builder->appendLine("    unsigned bytes = (bit % 8 + width + 7) / 8;");
+    builder->appendLine("    uint64_t value = 0;");
+    builder->appendLine("    for (unsigned i = 0; i < bytes; i++)");
+    builder->appendLine("        value = value << 8 | p[i];");
+    builder->appendLine("    return (uint32_t) ((value >> (bytes * 8 - bit % 8 - width)) &");
+    builder->appendLine("                       ((((uint64_t) 1) << width) - 1));");
+    builder->blockEnd(true);
+}
+
+}  // namespace FPP
@@ -0,0 +1,88 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPFUSEDSELECT_H_
+#define _BACKENDS_FPP_FPPFUSEDSELECT_H_
+
+#include "fppParser.h"
+#include "fppStaticOffsets.h"
+
+namespace FPP {
+
+// Select of a state composed with the selects of the successors it leads
+// to, as long as their headers and keys lie at offsets that are static
+// relative to the end of the first state. The fused states form a tree;
+// the key of each node is compressed to the index of its distinct target
+// ("class"), and the concatenated classes index a dense table of paths.
+// One bounds check covers the keys and extracts of all nodes; the path is
+// then dispatched with one computed goto to a stub which runs the skipped
+// states without bounds checks and continues at the final target.
+class FPPFusedSelect {
+ public:
+    struct Node {
+        const FPPParserState* state;
+        int parent;  // -1 for the first state
+        // Bits between the end of the first state and the start of the
+        // node; 'offsets' has the headers extracted on the path and ends
+        // with the node, or at an advance by a packet-dependent amount,
+        // after which the node has no fused successors.
+        unsigned offset;
+        FPPStaticOffsets offsets;
+        // Location of the key relative to the end of the first state; the
+        // key of the first state is evaluated as written.
+        unsigned keyOffset, keyWidth;
+        uint32_t keyMask;
+        std::vector<cstring> targets;  // distinct targets, indexed by class
+        std::vector<int> children;  // fused node of each class, -1 if final
+        std::vector<std::pair<uint32_t, unsigned>> cases;  // key value, class
+        unsigned defaultClass;
+        unsigned bits, shift;  // width and position of the class in the index
+    };
+    // States run after the dispatch: the fused nodes on the path and the
+    // target they lead to.
+    struct Stub {
+        std::vector<int> path;
+        cstring target;
+    };
+
+    const FPPParserState* state;
+    std::vector<Node> nodes;
+    std::vector<Stub> stubs;
+    std::vector<uint8_t> table;  // index of the stub per concatenation of classes
+    unsigned bits;
+    // Bits past the end of the first state which the keys and the skipped
+    // extracts read; the table is only used when they are available.
+    unsigned span;
+
+    // Returns nullptr if the state's select cannot be fused with at least
+    // one successor within maxBits of concatenated classes.
+    static FPPFusedSelect* build(const FPPParserState* state, unsigned maxBits);
+    cstring stubLabel(size_t stub) const;
+    static void emitHelpers(CodeBuilder* builder);
+
+ private:
+    explicit FPPFusedSelect(const FPPParserState* state) :
+            state(state), bits(0), span(0) {}
+    static unsigned keyWidth(const FPPParserState* ps);
+    static void classify(const FPPParserState* ps, Node& node);
+    bool addNode(int parent, const FPPParserState* ps, unsigned maxBits);
+    bool onPath(int node, const FPPParserState* ps) const;
+    size_t evaluate(unsigned index);
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPFUSEDSELECT_H_ */
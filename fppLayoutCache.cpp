@@ -0,0 +1,344 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "fppLayoutCache.h"
+#include "fppModel.h"
+#include "fppPaths.h"
+#include "fppChecksum.h"
+#include "frontends/p4/coreLibrary.h"
+
+namespace FPP {
+
+namespace {
+class ControlFields : public Inspector {
+    const P4::TypeMap* typeMap;
+ public:
+    std::map<cstring, std::set<cstring>> fields;
+    // The packet is read other than by extract, e.g. by lookahead.
+    bool rawAccess = false;
+
+    explicit ControlFields(const P4::TypeMap* typeMap) : typeMap(typeMap) {}
+    bool preorder(const IR::Member* member) override {
+        auto type = typeMap->getType(member->expr, true);
+        if (auto ht = type->to<IR::Type_Header>())
+            fields[ht->name.name].insert(member->member.name);
+        return true;
+    }
+    bool preorder(const IR::MethodCallExpression* mce) override {
+        auto method = mce->method->to<IR::Member>();
+        auto& p4lib = P4::P4CoreLibrary::instance;
+        if (method != nullptr && (method->member.name == p4lib.packetIn.lookahead.name ||
+                                  method->member.name == p4lib.packetIn.length.name))
+            rawAccess = true;
+        return true;
+    }
+};
+}  // namespace
+
+bool FPPLayoutCache::build() {
+    ControlFields collector(parser->typeMap);
+    for (auto ps : parser->states)
+        ps->state->apply(collector);
+    if (collector.rawAccess) {
+        ::error("--layout-cache: the parser uses lookahead or the packet length");
+        return false;
+    }
+    control = collector.fields;
+
+    // Headers with a varbit field end the cacheable part of a packet, they
+    // are never replayed.
+    FPPPaths paths(parser);
+    std::set<cstring> names;
+    for (auto ps : parser->states) {
+        for (auto name : paths.headersOf(ps))
+            names.insert(name);
+    }
+    for (auto d : parser->program->program->objects) {
+        auto ht = d->to<IR::Type_Header>();
+        if (ht == nullptr || names.count(ht->name.name) == 0)
+            continue;
+        bool varbit = false;
+        for (auto f : ht->fields)
+            varbit = varbit || f->type->is<IR::Type_Varbits>();
+        if (!varbit)
+            headers.push_back(ht);
+    }
+    return true;
+}
+
+cstring FPPLayoutCache::extractFunction(cstring header) const {
+    return FPPModel::reserved("extract_") + header;
+}
+
+// The macros carry the prefix, so parsers built with different --prefix
+// and --layout-cache can be included together.
+void FPPLayoutCache::emitTypes(CodeBuilder* builder, unsigned entries) const {
+    cstring bytes = FPPModel::macro("FPP_LAYOUT_BYTES");
+    cstring headerCount = FPPModel::macro("FPP_LAYOUT_HEADERS");
+    cstring entryCount = FPPModel::macro("FPP_LAYOUT_ENTRIES");
+    builder->appendFormat("#ifndef %s", bytes.c_str());
+    builder->newline();
+    builder->appendFormat("#define %s 128", bytes.c_str());
+    builder->newline();
+    builder->appendLine("#endif");
+    builder->appendFormat("#define %s 16", headerCount.c_str());
+    builder->newline();
+    builder->appendFormat("#define %s %u", entryCount.c_str(), entries);
+    builder->newline();
+    builder->appendFormat("struct %s ", FPPModel::reserved("layout").c_str());
+    builder->blockStart();
+    builder->appendLine("    uint32_t span;  /* the masked bytes are below span */");
+    builder->appendLine("    uint32_t length;  /* packets shorter than length do not match */");
+    builder->appendFormat("    uint32_t count;  /* headers, above %s if not cacheable */",
+                          headerCount.c_str());
+    builder->newline();
+    builder->appendFormat("    uint8_t mask[%s];", bytes.c_str());
+    builder->newline();
+    builder->appendFormat("    uint8_t value[%s];", bytes.c_str());
+    builder->newline();
+    builder->appendFormat("    enum %s types[%s];", FPPModel::reserved("headers").c_str(),
+                          headerCount.c_str());
+    builder->newline();
+    builder->appendFormat("    uint32_t offsets[%s];  /* in bits */", headerCount.c_str());
+    builder->newline();
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+    builder->appendFormat("struct %s ", parser->program->cacheType.c_str());
+    builder->blockStart();
+    builder->appendLine("    uint32_t used, next, last;");
+    builder->appendFormat("    struct %s entries[%s];",
+                          FPPModel::reserved("layout").c_str(), entryCount.c_str());
+    builder->newline();
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+}
+
+// The layout hit last is tried first; entries are replaced round-robin.
+void FPPLayoutCache::emitHelpers(CodeBuilder* builder) const {
+    cstring bytes = FPPModel::macro("FPP_LAYOUT_BYTES");
+    cstring headerCount = FPPModel::macro("FPP_LAYOUT_HEADERS");
+    cstring entryCount = FPPModel::macro("FPP_LAYOUT_ENTRIES");
+    cstring layout = FPPModel::reserved("layout");
+    cstring cache = parser->program->cacheType;
+    builder->appendFormat("static struct %s *%s(struct %s *cache, const uint8_t *packet, "
+                          "uint32_t packet_len)", layout.c_str(),
+                          FPPModel::reserved("layout_find").c_str(), cache.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    for (uint32_t n = 0; n < cache->used; n++) {");
+    builder->appendLine("        uint32_t i = (cache->last + n) % cache->used;");
+    builder->appendFormat("        const struct %s *l = &cache->entries[i];", layout.c_str());
+    builder->newline();
+    builder->appendLine("        if (packet_len < l->length)");
+    builder->appendLine("            continue;");
+    builder->appendLine("        uint8_t diff = 0;");
+    builder->appendLine("        for (uint32_t b = 0; b < l->span; b++)");
+    builder->appendLine("            diff |= (packet[b] & l->mask[b]) ^ l->value[b];");
+    builder->appendLine("        if (diff == 0) {");
+    builder->appendLine("            cache->last = i;");
+    builder->appendLine("            return &cache->entries[i];");
+    builder->appendLine("        }");
+    builder->appendLine("    }");
+    builder->appendLine("    return NULL;");
+    builder->blockEnd(true);
+    builder->newline();
+
+    builder->appendFormat("static void %s(struct %s *rec, const uint8_t *packet, "
+                          "uint64_t bit, unsigned width)",
+                          FPPModel::reserved("layout_mark").c_str(), layout.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    uint64_t last = (bit + width + 7) / 8;");
+    builder->appendFormat("    if (last > %s) {", bytes.c_str());
+    builder->newline();
+    builder->appendFormat("        rec->count = %s + 1;", headerCount.c_str());
+    builder->newline();
+    builder->appendLine("        return;");
+    builder->appendLine("    }");
+    builder->appendLine("    for (uint64_t b = bit / 8; b < last; b++) {");
+    builder->appendLine("        rec->mask[b] = 0xff;");
+    builder->appendLine("        rec->value[b] = packet[b];");
+    builder->appendLine("    }");
+    builder->appendLine("    if (last > rec->span)");
+    builder->appendLine("        rec->span = (uint32_t) last;");
+    builder->blockEnd(true);
+    builder->newline();
+
+    builder->appendFormat("static void %s(struct %s *cache, const struct %s *rec)",
+                          FPPModel::reserved("layout_install").c_str(), cache.c_str(),
+                          layout.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendFormat("    if (rec->count > %s)", headerCount.c_str());
+    builder->newline();
+    builder->appendLine("        return;");
+    builder->appendFormat("    uint32_t i = cache->used < %s ? cache->used++ :",
+                          entryCount.c_str());
+    builder->newline();
+    builder->appendFormat("                 cache->next++ %% %s;", entryCount.c_str());
+    builder->newline();
+    builder->appendLine("    cache->entries[i] = *rec;");
+    builder->blockEnd(true);
+
+    for (auto ht : headers) {
+        builder->newline();
+        parser->emitExtractFunction(builder, ht, extractFunction(ht->name.name));
+    }
+}
+
+void FPPLayoutCache::emitLookup(CodeBuilder* builder) const {
+    auto program = parser->program;
+    cstring list = FPPModel::global("packet_hdr_t");
+    builder->emitIndent();
+    builder->appendFormat("struct %s *%s = %s(cache, packet, packet_len)",
+                          FPPModel::reserved("layout").c_str(), program->layoutVar.c_str(),
+                          FPPModel::reserved("layout_find").c_str());
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("if (%s != NULL) ", program->layoutVar.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("for (uint32_t i = 0; i < %s->count; i++) ", program->layoutVar.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("void *h = NULL");
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("switch (%s->types[i]) ", program->layoutVar.c_str());
+    builder->blockStart();
+    for (auto ht : headers) {
+        cstring type = FPPModel::global(ht->name.name);
+        builder->emitIndent();
+        builder->appendFormat("case %s:", FPPModel::reserved(ht->name.name).c_str());
+        builder->newline();
+        builder->increaseIndent();
+        builder->emitIndent();
+        builder->appendFormat("if ((h = malloc(sizeof(struct %s))) == NULL)", type.c_str());
+        builder->newline();
+        builder->emitIndent();
+        builder->append("    break;");
+        builder->newline();
+        builder->emitIndent();
+        builder->appendFormat("%s(packet, %s->offsets[i], (struct %s *) h);",
+                              extractFunction(ht->name.name).c_str(),
+                              program->layoutVar.c_str(), type.c_str());
+        builder->newline();
+        // Checksums cover bytes outside the recorded control fields.
+        auto checksum = FPPChecksum::kind(ht);
+        if (checksum != nullptr)
+            FPPChecksum::emitVerify(builder, checksum, cstring("(*(struct ") + type + " *) h)",
+                                    cstring("BYTES(") + program->layoutVar + "->offsets[i])",
+                                    program->checksumL3Var);
+        builder->emitIndent();
+        builder->append("break;");
+        builder->newline();
+        builder->decreaseIndent();
+    }
+    builder->emitIndent();
+    builder->append("default:");
+    builder->newline();
+    builder->emitIndent();
+    builder->append("    break;");
+    builder->newline();
+    builder->blockEnd(true);
+    builder->emitIndent();
+    builder->appendFormat("if (h == NULL) { %s = %s; goto %s; }", program->errorVar.c_str(),
+                          program->outOfMemory.c_str(), program->endLabel.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("hdr = (%s *) malloc(sizeof(%s));", list.c_str(), list.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("if (hdr == NULL) { free(h); %s = %s; goto %s; }",
+                          program->errorVar.c_str(), program->outOfMemory.c_str(),
+                          program->endLabel.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("hdr->type = %s->types[i];", program->layoutVar.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->append("hdr->hdr = h;");
+    builder->newline();
+    builder->emitIndent();
+    builder->append("hdr->next = NULL;");
+    builder->newline();
+    builder->emitIndent();
+    builder->append("if (*out == NULL) *out = hdr; else last_hdr->next = hdr;");
+    builder->newline();
+    builder->emitIndent();
+    builder->append("last_hdr = hdr;");
+    builder->newline();
+    builder->blockEnd(true);
+    builder->emitIndent();
+    program->emitReturn(builder, program->noError);
+    builder->newline();
+    builder->blockEnd(true);
+}
+
+void FPPLayoutCache::emitRecord(CodeBuilder* builder, const IR::Type_Header* ht,
+                                cstring offset, bool listed) const {
+    auto program = parser->program;
+    cstring rec = program->recordVar;
+    cstring headerCount = FPPModel::macro("FPP_LAYOUT_HEADERS");
+    unsigned bit = 0;
+    bool varbit = false;
+    auto fields = control.find(ht->name.name);
+    for (auto f : ht->fields) {
+        if (f->type->is<IR::Type_Varbits>()) {
+            varbit = true;
+            break;
+        }
+        unsigned width = f->type->width_bits();
+        if (fields != control.end() && fields->second.count(f->name.name) != 0) {
+            builder->emitIndent();
+            builder->appendFormat("%s(&%s, %s, %s + %u, %u);",
+                                  FPPModel::reserved("layout_mark").c_str(), rec.c_str(),
+                                  program->packetStartVar.c_str(), offset.c_str(),
+                                  bit, width);
+            builder->newline();
+        }
+        bit += width;
+    }
+
+    // Headers with a varbit field are not replayed.
+    builder->emitIndent();
+    if (varbit) {
+        builder->appendFormat("%s.count = %s + 1;", rec.c_str(), headerCount.c_str());
+        builder->newline();
+        return;
+    }
+    if (listed) {
+        builder->appendFormat("if (%s.count < %s) { %s.types[%s.count] = %s; "
+                              "%s.offsets[%s.count] = (uint32_t) %s; }", rec.c_str(),
+                              headerCount.c_str(),
+                              rec.c_str(), rec.c_str(),
+                              FPPModel::reserved(ht->name.name).c_str(), rec.c_str(),
+                              rec.c_str(), offset.c_str());
+        builder->newline();
+        builder->emitIndent();
+        builder->appendFormat("%s.count++;", rec.c_str());
+        builder->newline();
+        builder->emitIndent();
+    }
+    builder->appendFormat("if (%s.length < BYTES(%s + %u + 7)) %s.length = BYTES(%s + %u + 7);",
+                          rec.c_str(), offset.c_str(), bit, rec.c_str(),
+                          offset.c_str(), bit);
+    builder->newline();
+}
+
+}  // namespace FPP
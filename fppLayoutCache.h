@@ -0,0 +1,58 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPLAYOUTCACHE_H_
+#define _BACKENDS_FPP_FPPLAYOUTCACHE_H_
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "fppParser.h"
+
+namespace FPP {
+
+// Cache of the header layouts of accepted packets. The path through the
+// parser is decided by the header fields the parser reads; while parsing
+// a packet the bytes of these fields are recorded as a mask and a value,
+// together with the type and offset of each extracted header. A packet
+// matching the masked bytes of a cached layout has the same headers at
+// the same offsets, so they are extracted without running the states.
+class FPPLayoutCache {
+    const FPPParser* parser;
+
+ public:
+    // Fields of each header type read by the parser.
+    std::map<cstring, std::set<cstring>> control;
+    // Header types extracted into the headers structure.
+    std::vector<const IR::Type_Header*> headers;
+
+    explicit FPPLayoutCache(const FPPParser* parser) : parser(parser) {}
+    bool build();
+
+    cstring extractFunction(cstring header) const;
+    void emitTypes(CodeBuilder* builder, unsigned entries) const;
+    void emitHelpers(CodeBuilder* builder) const;
+    // Parses the packet from a cached layout if one matches.
+    void emitLookup(CodeBuilder* builder) const;
+    // Records the header of type 'ht' extracted at the bit offset 'offset'.
+    void emitRecord(CodeBuilder* builder, const IR::Type_Header* ht, cstring offset,
+                    bool listed) const;
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPLAYOUTCACHE_H_ */
@@ -16,11 +16,26 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <ctype.h>
+
 #include "fppModel.h"
 
 namespace FPP {
 
 cstring FPPModel::reservedPrefix = "fpp_";
+cstring FPPModel::globalPrefix = "";
+
+cstring FPPModel::macro(cstring name) {
+    std::string upper = globalPrefix.c_str();
+    for (auto& c : upper)
+        c = toupper(static_cast<unsigned char>(c));
+    return upper + name;
+}
+
+void FPPModel::setPrefix(cstring prefix) {
+    reservedPrefix = prefix;
+    globalPrefix = prefix;
+}
 FPPModel FPPModel::instance;
 
 }  // namespace FPP
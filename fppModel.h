@@ -42,12 +42,20 @@ class FPPModel : public ::Model::Model {
  public:
     static FPPModel instance;
     static cstring reservedPrefix;
+    // Prepended to the other global names (types, error codes, header
+    // guard) by --prefix; empty by default.
+    static cstring globalPrefix;
 
     ::Model::Param_Model   packet;
     Parser_Model           parser;
 
     static cstring reserved(cstring name)
     { return reservedPrefix + name; }
+    static cstring global(cstring name)
+    { return globalPrefix + name; }
+    // Macros use the upper-case global prefix.
+    static cstring macro(cstring name);
+    static void setPrefix(cstring prefix);
 };
 
 }  // namespace FPP
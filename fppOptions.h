@@ -19,13 +19,221 @@ limitations under the License.
 #ifndef _BACKENDS_FPP_FPPOPTIONS_H_
 #define _BACKENDS_FPP_FPPOPTIONS_H_
 
+#include <ctype.h>
 #include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "lib/error.h"
 #include "frontends/common/options.h"
 
 class FPPOptions : public CompilerOptions {
  public:
+    // emit per-transition counters and a profile dump function
+    bool instrument = false;
+    // transition profile recorded by an instrumented parser
+    cstring profileUse = nullptr;
+    // states reached by speculative fast paths, "profile" for the hottest path
+    std::vector<cstring> fastPaths;
+    // maximum width of the concatenated key classes indexing a fused
+    // transition table, 0 disables
+    unsigned fuseBits = 0;
+    // dispatch selects through a label table instead of a switch
+    bool branchless = false;
+    // number of iterations of a self-looping state behind one bounds check
+    unsigned unrollDepth = 0;
+    // instruction set extensions of the parse function clones
+    std::vector<cstring> isas;
+    // emit a parse function stopping after headers selected at runtime
+    bool stopMask = false;
+    // "name=member[,member...]" specs of specialized parse functions
+    std::vector<cstring> variants;
+    // prefix of all emitted global names, nullptr keeps the default names
+    cstring prefix = nullptr;
+    // emit a parse function for captures shorter than the packet on the wire
+    bool truncation = false;
+    // emit a parse function taking the packet as an iovec array
+    bool segments = false;
+    // per-packet caps raising ParserTimeout, 0 if not enforced
+    unsigned maxVisits = 0;
+    unsigned maxTunnels = 0;
+    unsigned maxBytes = 0;
+    // hash of the @flow_key fields, "crc32c" or "toeplitz"
+    cstring flowHash = "crc32c";
+    // emit a parse function returning the header bitmap and the path id
+    bool classify = false;
+    // states at which the suspendable parser saves a continuation
+    std::vector<cstring> suspendAt;
+    // entries of the layout cache of fpp_parse_cached(), 0 if not emitted
+    unsigned layoutCache = 0;
+    // clauses a packet must satisfy, nullptr to accept all packets
+    cstring filter = nullptr;
+    // emit field setters, header emit functions and push/pop helpers
+    bool rewrite = false;
+    // datagrams in the fragment table of fpp_reassemble(), 0 if not emitted
+    unsigned reassembly = 0;
+
     FPPOptions() {
         langVersion = CompilerOptions::FrontendVersion::P4_16;
+        registerOption("--instrument", nullptr,
+                [this](const char*) { instrument = true; return true; },
+                "Count taken parser transitions; the counts can be written "
+                "to a profile file using the generated fpp_profile_dump()");
+        registerOption("--profile-use", "file",
+                [this](const char* arg) { profileUse = arg; return true; },
+                "Optimize transitions and state layout using a profile "
+                "written by an instrumented parser");
+        registerOption("--fast-path", "state[,state...]",
+                [this](const char* arg) {
+                    auto copy = strdup(arg);
+                    for (auto s = strtok(copy, ","); s != nullptr; s = strtok(nullptr, ","))
+                        fastPaths.push_back(cstring(s));
+                    free(copy);
+                    return true; },
+                "Emit a speculative straight-line parser for the path from start "
+                "to each listed state; 'profile' selects the hottest profiled path");
+        registerOption("--fuse-transitions", "bits",
+                [this](const char* arg) {
+                    fuseBits = strtoul(arg, nullptr, 10);
+                    if (fuseBits == 0 || fuseBits > 16) {
+                        ::error("--fuse-transitions expects 1 to 16 bits");
+                        return false;
+                    }
+                    return true; },
+                "Dispatch chains of selects through states at static offsets using "
+                "one table indexed by up to 'bits' bits of concatenated key classes");
+        registerOption("--branchless", nullptr,
+                [this](const char*) { branchless = true; return true; },
+                "Select transitions with branch-free compares and a single "
+                "indirect jump, for predictable cost on hostile traffic");
+        registerOption("--unroll-depth", "N",
+                [this](const char* arg) {
+                    unrollDepth = strtoul(arg, nullptr, 10);
+                    if (unrollDepth < 2 || unrollDepth > 16) {
+                        ::error("--unroll-depth expects 2 to 16 iterations");
+                        return false;
+                    }
+                    return true; },
+                "Unroll self-looping states with a constant size (MPLS, VLAN) "
+                "N times behind a shared bounds check");
+        registerOption("--multiversion", "isa[,isa...]",
+                [this](const char* arg) {
+                    auto copy = strdup(arg);
+                    for (auto s = strtok(copy, ","); s != nullptr; s = strtok(nullptr, ","))
+                        isas.push_back(cstring(s));
+                    free(copy);
+                    return true; },
+                "Emit copies of the parse functions compiled for the listed "
+                "instruction sets (e.g. sse4.2,avx2,avx512f), oldest first, and "
+                "select the best one for the host at load time");
+        registerOption("--stop-mask", nullptr,
+                [this](const char*) { stopMask = true; return true; },
+                "Emit fpp_parse_packet_until() which accepts the packet as soon "
+                "as a header type selected by its 'stop' mask is extracted");
+        registerOption("--variant", "name=member[,member...]",
+                [this](const char* arg) { variants.push_back(arg); return true; },
+                "Emit fpp_parse_<name>() returning only the listed members of the "
+                "headers structure; may be given several times");
+        registerOption("--prefix", "prefix",
+                [this](const char* arg) {
+                    for (auto c = arg; *c != '\0'; c++) {
+                        if (!isalnum(static_cast<unsigned char>(*c)) && *c != '_') {
+                            ::error("--prefix must be a C identifier");
+                            return false;
+                        }
+                    }
+                    prefix = arg;
+                    return true; },
+                "Prefix all emitted functions, types, error codes and macros "
+                "so that several parsers can be linked into one program");
+        registerOption("--truncation", nullptr,
+                [this](const char*) { truncation = true; return true; },
+                "Emit fpp_parse_truncated() taking the captured and the wire "
+                "length; headers cut off by the capture end parsing with 'Truncated'");
+        registerOption("--segments", nullptr,
+                [this](const char*) { segments = true; return true; },
+                "Emit fpp_parse_segments() parsing a packet split into iovec segments "
+                "without copying it into one buffer");
+        registerOption("--max-visits", "N",
+                [this](const char* arg) {
+                    maxVisits = strtoul(arg, nullptr, 10);
+                    if (maxVisits == 0) {
+                        ::error("--max-visits expects a positive number");
+                        return false;
+                    }
+                    return true; },
+                "Fail with ParserTimeout after N visits of states on a cycle "
+                "of the parser graph");
+        registerOption("--max-tunnels", "N",
+                [this](const char* arg) {
+                    maxTunnels = strtoul(arg, nullptr, 10);
+                    if (maxTunnels == 0) {
+                        ::error("--max-tunnels expects a positive number");
+                        return false;
+                    }
+                    return true; },
+                "Fail with ParserTimeout after N visits of states annotated with @tunnel");
+        registerOption("--max-bytes", "N",
+                [this](const char* arg) {
+                    maxBytes = strtoul(arg, nullptr, 10);
+                    if (maxBytes == 0) {
+                        ::error("--max-bytes expects a positive number");
+                        return false;
+                    }
+                    return true; },
+                "Fail with ParserTimeout when a state on a cycle is entered past "
+                "the first N bytes of the packet");
+        registerOption("--flow-hash", "crc32c|toeplitz",
+                [this](const char* arg) {
+                    flowHash = arg;
+                    if (flowHash != "crc32c" && flowHash != "toeplitz") {
+                        ::error("--flow-hash expects crc32c or toeplitz");
+                        return false;
+                    }
+                    return true; },
+                "Hash of the flow key output by the parsers: CRC32C (default) "
+                "or symmetric Toeplitz for RSS-style dispatch");
+        registerOption("--classify", nullptr,
+                [this](const char*) { classify = true; return true; },
+                "Add an optional output to the parsers for a bitmap of the extracted "
+                "header types and the number of the path through the parser");
+        registerOption("--suspend-at", "state[,state...]",
+                [this](const char* arg) {
+                    auto copy = strdup(arg);
+                    for (auto s = strtok(copy, ","); s != nullptr; s = strtok(nullptr, ","))
+                        suspendAt.push_back(cstring(s));
+                    free(copy);
+                    return true; },
+                "Emit fpp_parse_suspend() which stops before the listed states and "
+                "saves a continuation, and fpp_parse_resume() which continues from it");
+        registerOption("--layout-cache", "N",
+                [this](const char* arg) {
+                    layoutCache = strtoul(arg, nullptr, 10);
+                    if (layoutCache == 0) {
+                        ::error("--layout-cache expects a positive number");
+                        return false;
+                    }
+                    return true; },
+                "Emit fpp_parse_cached() which remembers the header layouts of up to "
+                "N accepted packets and extracts matching packets without parsing");
+        registerOption("--filter", "expression",
+                [this](const char* arg) { filter = arg; return true; },
+                "Stop parsing with Filtered as soon as the extracted headers cannot "
+                "satisfy the expression, e.g. \"ipv4 && (!tcp || tcp.dstPort != 443)\"");
+        registerOption("--rewrite", nullptr,
+                [this](const char*) { rewrite = true; return true; },
+                "Emit functions modifying parsed packets in place: a setter per "
+                "header field, an emit function per header and encapsulation push and pop");
+        registerOption("--reassembly", "N",
+                [this](const char* arg) {
+                    reassembly = strtoul(arg, nullptr, 10);
+                    if (reassembly == 0) {
+                        ::error("--reassembly expects a positive number");
+                        return false;
+                    }
+                    return true; },
+                "Emit fpp_reassemble() which collects the fragments of up to N IP "
+                "datagrams in a fixed-size table and returns the reassembled datagrams");
     }
 };
 
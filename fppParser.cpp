@@ -16,9 +16,22 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <algorithm>
+#include <set>
+
 #include "fppModel.h"
 #include "fppParser.h"
 #include "fppType.h"
+#include "fppProfile.h"
+#include "fppFusedSelect.h"
+#include "fppVariant.h"
+#include "fppTlv.h"
+#include "fppFlowKey.h"
+#include "fppPaths.h"
+#include "fppLayoutCache.h"
+#include "fppFilter.h"
+#include "fppChecksum.h"
+#include "fppFragment.h"
 #include "frontends/p4/coreLibrary.h"
 #include "frontends/p4/methodInstance.h"
 
@@ -27,21 +40,86 @@ namespace FPP {
 namespace {
 class StateTranslationVisitor : public CodeGenInspector {
     bool hasDefault;
+    unsigned caseIndex;
     bool is_headers_type;
     bool headers_path;
     P4::P4CoreLibrary& p4lib;
     const FPPParserState* state;
+    // Speculative states are emitted without a label and bounds checks,
+    // the verified transition replaces the select.
+    bool speculative;
+    const FPPTransition* verified;
+    bool fallthrough;
+    // Only the components are emitted, for a state skipped by a fused
+    // select; the stub jumps to the target itself.
+    bool componentsOnly;
+    // The select dispatched through the fused table; the stubs of its
+    // paths follow the state.
+    bool fusedEmitted;
+    // Label of the emitted block, nullptr for speculative states. Inside an
+    // unrolled iteration the self-loop jumps to 'loopTarget'.
+    cstring label;
+    cstring loopTarget;
+    // index of the unrolled copy of the state; the copies read at constant
+    // offsets from the offset at the start of the unrolled block and
+    // 'consumed' bits past it
+    unsigned iteration;
+    unsigned consumed;
+    // varbit lengths declared in the state so far
+    unsigned varbits;
+    // Name of the function extracting a header type visited by this
+    // visitor, nullptr when translating states.
+    cstring extractFunction;
 
     void compileExtractField(const IR::Expression* expr, cstring name,
                              unsigned alignment, FPPType* type);
     void compileExtract(const IR::Vector<IR::Argument>* args);
+    void emitListAppend(cstring object, cstring type);
+    void emitTlvWalk(const IR::Expression* expr, cstring field, cstring kind);
+    void compileExtractVarbit(const IR::Expression* expr, cstring field,
+                              const FPPVarbitType* type, cstring length, unsigned remaining);
     void compileLookahead(const IR::Type* args);
+    void emitBoundsCheck(unsigned width);
+    void emitFusedSelect(const FPPFusedSelect* fused);
+    void emitFusedStubs(const FPPFusedSelect* fused);
+    bool emitBranchlessSelect(const IR::SelectExpression* expression);
+    void emitGoto(const FPPTransition* transition, bool fallthrough = false);
+    void emitUnrolled(const IR::ParserState* parserState);
+    void emitBudgetCheck(const IR::ParserState* parserState);
+    std::vector<std::pair<cstring, unsigned>> budgetCounters() const;
+    cstring unrolledExit(const FPPTransition* transition) const;
+    cstring offsetExpr() const;
+    void emitAdvance(unsigned bits);
+    cstring target(const FPPTransition* transition) const;
 
  public:
     explicit StateTranslationVisitor(const FPPParserState* state) :
             CodeGenInspector(state->parser->program->refMap, state->parser->program->typeMap),
-            hasDefault(false), p4lib(P4::P4CoreLibrary::instance), state(state), is_headers_type(false) {}
+            hasDefault(false), caseIndex(0), p4lib(P4::P4CoreLibrary::instance), state(state),
+            speculative(false), verified(nullptr), fallthrough(false),
+            componentsOnly(false), fusedEmitted(false),
+            label(state->state->name.name), loopTarget(nullptr), iteration(0), consumed(0),
+            varbits(0), extractFunction(nullptr), is_headers_type(false) {}
+    void setSpeculative(const FPPTransition* verified, bool fallthrough) {
+        speculative = true;
+        this->verified = verified;
+        this->fallthrough = fallthrough;
+        label = nullptr;
+    }
+    void setIteration(unsigned iteration, cstring label, cstring loopTarget) {
+        setSpeculative(nullptr, false);
+        this->iteration = iteration;
+        this->consumed = iteration * state->iterationBits;
+        this->label = label;
+        this->loopTarget = loopTarget;
+    }
+    void setComponentsOnly() {
+        setSpeculative(nullptr, false);
+        componentsOnly = true;
+    }
+    void setExtractFunction(cstring name) { extractFunction = name; }
     bool preorder(const IR::ParserState* state) override;
+    bool preorder(const IR::Type_Header* type) override;
     bool preorder(const IR::SelectCase* selectCase) override;
     bool preorder(const IR::SelectExpression* expression) override;
     bool preorder(const IR::Member* expression) override;
@@ -56,21 +134,46 @@ class StateTranslationVisitor : public CodeGenInspector {
 bool StateTranslationVisitor::preorder(const IR::ParserState* parserState) {
     if (parserState->isBuiltin()) return false;
 
+    auto program = state->parser->program;
+    auto profile = state->parser->profile;
     builder->emitIndent();
-    builder->append(parserState->name.name);
-    builder->append(":");
-    builder->spc();
+    if (label != nullptr) {
+        builder->append(label);
+        builder->append(":");
+        builder->spc();
+        if (!speculative && profile != nullptr && profile->isCold(parserState->name.name))
+            builder->append("__attribute__((cold)); ");
+    }
     builder->blockStart();
 
+    if (!speculative || componentsOnly)
+        emitBudgetCheck(parserState);
+    if (!speculative && state->iterationBits != 0)
+        emitUnrolled(parserState);
+
     setVecSep("\n", "\n");
     visit(parserState->components, "components");
     doneVec();
 
-    if (parserState->selectExpression == nullptr) {
+    if (componentsOnly) {
+        builder->blockEnd(true);
+        return false;
+    }
+
+    caseIndex = 0;
+    if (verified != nullptr) {
+        if (fallthrough && program->classifying)
+            program->paths->emitStep(builder, verified->from->state->name.name, verified->to,
+                                     program->pathIdVar, program->loopedVar);
+        if (!fallthrough || program->options.instrument) {
+            builder->emitIndent();
+            emitGoto(verified, fallthrough);
+            builder->newline();
+        }
+    } else if (parserState->selectExpression == nullptr) {
         builder->emitIndent();
-        builder->append("goto ");
-        builder->append(IR::ParserState::reject);
-        builder->endOfStatement(true);
+        emitGoto(state->transitions.at(0));
+        builder->newline();
     } else if (parserState->selectExpression->is<IR::SelectExpression>()) {
         visit(parserState->selectExpression);
     } else {
@@ -78,11 +181,54 @@ bool StateTranslationVisitor::preorder(const IR::ParserState* parserState) {
         if (!parserState->selectExpression->is<IR::PathExpression>())
             BUG("Expected a PathExpression, got a %1%", parserState->selectExpression);
         builder->emitIndent();
-        builder->append("goto ");
-        visit(parserState->selectExpression);
-        builder->endOfStatement(true);
+        emitGoto(state->transitions.at(0));
+        builder->newline();
+    }
+    if (fusedEmitted)
+        emitFusedStubs(state->fused);
+
+    builder->blockEnd(true);
+    return false;
+}
+
+// Extracts a header at a given offset outside the state machine; the
+// caller has checked that the packet is long enough.
+bool StateTranslationVisitor::preorder(const IR::Type_Header* type) {
+    if (extractFunction == nullptr)
+        return false;
+
+    auto program = state->parser->program;
+    cstring hdr_struct = FPPModel::global(type->name.name);
+    builder->appendFormat("static void %s(const uint8_t *%s, uint64_t %s, struct %s *out)",
+                          extractFunction.c_str(), program->packetStartVar.c_str(),
+                          program->offsetVar.c_str(), hdr_struct.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("struct %s h", hdr_struct.c_str());
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("h.header_offset = %s / 8", program->offsetVar.c_str());
+    builder->endOfStatement(true);
+
+    auto expr = new IR::PathExpression("h");
+    unsigned alignment = 0;
+    for (auto f : type->fields) {
+        auto etype = FPPTypeFactory::instance->create(state->parser->typeMap->getType(f));
+        auto et = dynamic_cast<IHasWidth*>(etype);
+        if (et == nullptr || etype->is<FPPVarbitType>())
+            BUG("%1%: header with a varbit field cannot be cached", type);
+        compileExtractField(expr, f->name, alignment, etype);
+        alignment += et->widthInBits();
+        alignment %= 8;
     }
 
+    builder->emitIndent();
+    builder->append("h.header_valid = 1");
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->append("*out = h");
+    builder->endOfStatement(true);
     builder->blockEnd(true);
     return false;
 }
@@ -94,22 +240,83 @@ bool StateTranslationVisitor::preorder(const IR::SelectExpression* expression) {
         ::error("%1%: only supporting a single argument for select", expression->select);
         return false;
     }
+
+    // A fused table dispatches directly; the switch is only needed when the
+    // fused states read bits that may be past the end of the packet.
+    auto program = state->parser->program;
+    if (state->fused != nullptr && !program->options.instrument && !speculative &&
+        loopTarget == nullptr && !program->suspending) {
+        emitFusedSelect(state->fused);
+        fusedEmitted = true;
+        if (state->fused->span == 0)
+            return false;
+    }
+
+    // The label table of an unrolled copy cannot tell its exits apart.
+    if (program->options.branchless && loopTarget == nullptr &&
+        emitBranchlessSelect(expression))
+        return false;
+
+    // Transitions that dominate the profile are tested before the switch.
+    auto profile = state->parser->profile;
+    std::vector<const FPPTransition*> hot;
+    if (profile != nullptr)
+        hot = profile->hotTransitions(state);
+
+    if (!hot.empty()) {
+        auto key = expression->select->components.at(0);
+        auto keyType = FPPTypeFactory::instance->create(typeMap->getType(key, true));
+        builder->emitIndent();
+        builder->blockStart();
+        builder->emitIndent();
+        keyType->declare(builder, program->selectKeyVar, false);
+        builder->append(" = ");
+        visit(key);
+        builder->endOfStatement(true);
+
+        for (auto t : hot) {
+            bool likely = profile->isLikely(t);
+            builder->emitIndent();
+            builder->append("if (");
+            if (likely)
+                builder->append("__builtin_expect(");
+            builder->appendFormat("%s == ", program->selectKeyVar.c_str());
+            visit(t->selectCase->keyset);
+            if (likely)
+                builder->append(", 1)");
+            builder->append(") ");
+            emitGoto(t);
+            builder->newline();
+        }
+    }
+
     builder->emitIndent();
     builder->append("switch (");
-    visit(expression->select);
+    if (hot.empty())
+        visit(expression->select);
+    else
+        builder->append(program->selectKeyVar);
     builder->append(") ");
     builder->blockStart();
 
-    for (auto e : expression->selectCases)
-        visit(e);
+    for (auto e : expression->selectCases) {
+        auto transition = state->transitions.at(caseIndex);
+        if (std::find(hot.begin(), hot.end(), transition) == hot.end())
+            visit(e);
+        else
+            caseIndex++;
+    }
 
     if (!hasDefault) {
         builder->emitIndent();
-        builder->appendFormat("default: goto %s;", IR::ParserState::reject.c_str());
+        builder->append("default: ");
+        emitGoto(state->transitions.at(caseIndex));
         builder->newline();
     }
 
     builder->blockEnd(true);
+    if (!hot.empty())
+        builder->blockEnd(true);
     return false;
 }
 
@@ -123,12 +330,394 @@ bool StateTranslationVisitor::preorder(const IR::SelectCase* selectCase) {
         visit(selectCase->keyset);
         builder->append(": ");
     }
-    builder->append("goto ");
-    visit(selectCase->state);
-    builder->endOfStatement(true);
+    emitGoto(state->transitions.at(caseIndex++));
+    builder->newline();
     return false;
 }
 
+// Computes the class of each fused node, then jumps through the table
+// indexed by their concatenation.
+void StateTranslationVisitor::emitFusedSelect(const FPPFusedSelect* fused) {
+    auto program = state->parser->program;
+    builder->emitIndent();
+    if (fused->span != 0)
+        builder->appendFormat("if (%s >= %s + BYTES(%s + %d + 7)) ",
+                              program->packetEndVar.c_str(),
+                              program->packetStartVar.c_str(),
+                              program->offsetVar.c_str(), fused->span);
+    builder->blockStart();
+
+    builder->emitIndent();
+    builder->appendFormat("static void *const %s[] = { ", program->fusedLabelsVar.c_str());
+    for (size_t i = 0; i < fused->stubs.size(); i++)
+        builder->appendFormat(i == 0 ? "&&%s" : ", &&%s", fused->stubLabel(i).c_str());
+    builder->append(" }");
+    builder->endOfStatement(true);
+
+    builder->emitIndent();
+    builder->appendFormat("static const uint8_t %s[%d] = {", program->fusedTableVar.c_str(),
+                          static_cast<unsigned>(fused->table.size()));
+    builder->increaseIndent();
+    for (size_t i = 0; i < fused->table.size(); i++) {
+        if (i % 16 == 0) {
+            builder->newline();
+            builder->emitIndent();
+        }
+        builder->appendFormat("%d,", fused->table[i]);
+    }
+    builder->decreaseIndent();
+    builder->newline();
+    builder->emitIndent();
+    builder->append("}");
+    builder->endOfStatement(true);
+
+    for (size_t n = 0; n < fused->nodes.size(); n++) {
+        auto& node = fused->nodes[n];
+        if (node.bits == 0)
+            continue;
+        cstring key = program->fusedKeyVar + Util::toString(static_cast<unsigned>(n));
+        cstring cls = program->fusedClassVar + Util::toString(static_cast<unsigned>(n));
+        cstring classes = program->fusedClassesVar + Util::toString(static_cast<unsigned>(n));
+        builder->emitIndent();
+        builder->appendFormat("uint32_t %s = ", key.c_str());
+        if (n == 0) {
+            builder->append("(uint32_t)");
+            auto select = state->state->selectExpression->to<IR::SelectExpression>();
+            visit(select->select->components.at(0));
+        } else {
+            builder->appendFormat("%s(%s, %s + %d, %d)",
+                                  FPPModel::reserved("fused_key").c_str(),
+                                  program->packetStartVar.c_str(),
+                                  program->offsetVar.c_str(), node.keyOffset, node.keyWidth);
+            if (node.keyMask != (node.keyWidth >= 32 ? ~0u : (1u << node.keyWidth) - 1))
+                builder->appendFormat(" & 0x%x", node.keyMask);
+        }
+        builder->endOfStatement(true);
+
+        // Narrow keys look their class up, wider keys blend it from the
+        // cases in reverse so that the first matching case wins.
+        if (node.keyWidth <= 8) {
+            builder->emitIndent();
+            builder->appendFormat("static const uint8_t %s[%d] = { ", classes.c_str(),
+                                  1u << node.keyWidth);
+            for (uint32_t v = 0; v < (1u << node.keyWidth); v++) {
+                unsigned c = node.defaultClass;
+                for (auto& e : node.cases) {
+                    if (e.first == v) {
+                        c = e.second;
+                        break;
+                    }
+                }
+                builder->appendFormat(v == 0 ? "%d" : ", %d", c);
+            }
+            builder->append(" }");
+            builder->endOfStatement(true);
+            builder->emitIndent();
+            builder->appendFormat("uint32_t %s = %s[%s & 0x%x]", cls.c_str(), classes.c_str(),
+                                  key.c_str(), (1u << node.keyWidth) - 1);
+            builder->endOfStatement(true);
+        } else {
+            builder->emitIndent();
+            builder->appendFormat("uint32_t %s = %d", cls.c_str(), node.defaultClass);
+            builder->endOfStatement(true);
+            for (auto e = node.cases.rbegin(); e != node.cases.rend(); e++) {
+                builder->emitIndent();
+                builder->appendFormat("%s = %s == 0x%x ? %d : %s", cls.c_str(), key.c_str(),
+                                      e->first, e->second, cls.c_str());
+                builder->endOfStatement(true);
+            }
+        }
+    }
+
+    builder->emitIndent();
+    builder->appendFormat("goto *%s[%s[", program->fusedLabelsVar.c_str(),
+                          program->fusedTableVar.c_str());
+    bool first = true;
+    for (size_t n = 0; n < fused->nodes.size(); n++) {
+        auto& node = fused->nodes[n];
+        if (node.bits == 0)
+            continue;
+        if (!first)
+            builder->append(" | ");
+        builder->appendFormat("(%s%d << %d)", program->fusedClassVar.c_str(),
+                              static_cast<unsigned>(n), node.shift);
+        first = false;
+    }
+    builder->append("]];");
+    builder->newline();
+    builder->blockEnd(true);
+}
+
+// Each stub runs the states skipped on its path, without bounds checks as
+// the span has been checked, and continues at the final target.
+void StateTranslationVisitor::emitFusedStubs(const FPPFusedSelect* fused) {
+    auto program = state->parser->program;
+    auto variant = program->variant;
+    auto live = [variant](cstring name) {
+        return variant == nullptr || name == IR::ParserState::accept ||
+               name == IR::ParserState::reject || variant->isLive(name);
+    };
+
+    for (size_t i = 0; i < fused->stubs.size(); i++) {
+        auto& stub = fused->stubs[i];
+        builder->emitIndent();
+        builder->appendFormat("%s: ", fused->stubLabel(i).c_str());
+        builder->blockStart();
+        cstring target = stub.target;
+        cstring from = state->state->name.name;
+        bool cut = false;
+        for (auto n : stub.path) {
+            auto ps = fused->nodes[n].state;
+            if (!live(ps->state->name.name)) {
+                cut = true;
+                break;
+            }
+            if (program->classifying)
+                program->paths->emitStep(builder, from, ps->state->name.name,
+                                         program->pathIdVar, program->loopedVar);
+            from = ps->state->name.name;
+            StateTranslationVisitor skipped(ps);
+            skipped.setBuilder(builder);
+            skipped.setComponentsOnly();
+            ps->state->apply(skipped);
+        }
+        cut = cut || !live(target);
+        // The edges between the skipped states are counted here as the
+        // stub jumps past their labels.
+        if (cut)
+            target = program->classifying ? program->cutLabel : IR::ParserState::accept;
+        else if (program->classifying)
+            program->paths->emitStep(builder, from, target, program->pathIdVar,
+                                     program->loopedVar);
+        builder->emitIndent();
+        builder->appendFormat("goto %s;", target.c_str());
+        builder->newline();
+        builder->blockEnd(true);
+    }
+}
+
+// Selects the target index with masked blends, evaluated in reverse so
+// that the first matching case wins, and jumps through a label table.
+// Returns false if a keyset or the key type has no branch-free compare.
+bool StateTranslationVisitor::emitBranchlessSelect(const IR::SelectExpression* expression) {
+    auto program = state->parser->program;
+    auto key = expression->select->components.at(0);
+    auto type = typeMap->getType(key, true);
+    auto tb = type->to<IR::Type_Bits>();
+    // Wider keys are byte arrays, which have no scalar compare.
+    if (!type->is<IR::Type_Boolean>() &&
+        (tb == nullptr || !FPPScalarType::generatesScalar(tb->size)))
+        return false;
+
+    size_t defaultIndex = state->transitions.size() - 1;
+    for (auto t : state->transitions) {
+        if (t->isDefault()) {
+            defaultIndex = t->index;
+            break;
+        }
+        auto keyset = t->selectCase->keyset;
+        if (!keyset->is<IR::Constant>() && !keyset->is<IR::Mask>() &&
+            !keyset->is<IR::Range>())
+            return false;
+    }
+
+    auto keyType = FPPTypeFactory::instance->create(type);
+    builder->emitIndent();
+    builder->blockStart();
+
+    builder->emitIndent();
+    builder->appendFormat("static void *const %s[] = { ", program->targetLabelsVar.c_str());
+    for (size_t i = 0; i <= defaultIndex; i++)
+        builder->appendFormat(i == 0 ? "&&%s" : ", &&%s",
+                              target(state->transitions.at(i)).c_str());
+    builder->append(" }");
+    builder->endOfStatement(true);
+
+    builder->emitIndent();
+    keyType->declare(builder, program->selectKeyVar, false);
+    builder->append(" = ");
+    visit(key);
+    builder->endOfStatement(true);
+
+    builder->emitIndent();
+    builder->appendFormat("unsigned %s = %d", program->targetVar.c_str(),
+                          static_cast<unsigned>(defaultIndex));
+    builder->endOfStatement(true);
+
+    auto selectKey = program->selectKeyVar.c_str();
+    for (size_t i = defaultIndex; i-- > 0; ) {
+        auto keyset = state->transitions.at(i)->selectCase->keyset;
+        builder->emitIndent();
+        builder->appendFormat("%s ^= (%s ^ %d) & -(unsigned)(", program->targetVar.c_str(),
+                              program->targetVar.c_str(), static_cast<unsigned>(i));
+        if (auto mask = keyset->to<IR::Mask>()) {
+            builder->appendFormat("(%s & ", selectKey);
+            visit(mask->right);
+            builder->append(") == ");
+            visit(mask->left);
+        } else if (auto range = keyset->to<IR::Range>()) {
+            builder->appendFormat("(%s >= ", selectKey);
+            visit(range->left);
+            builder->appendFormat(") & (%s <= ", selectKey);
+            visit(range->right);
+            builder->append(")");
+        } else {
+            builder->appendFormat("%s == ", selectKey);
+            visit(keyset);
+        }
+        builder->append(")");
+        builder->endOfStatement(true);
+    }
+
+    // Transitions of a state have consecutive ids.
+    if (program->options.instrument) {
+        builder->emitIndent();
+        builder->appendFormat("%s[%d + %s]++", program->profileCounters.c_str(),
+                              state->transitions.at(0)->id, program->targetVar.c_str());
+        builder->endOfStatement(true);
+    }
+    builder->emitIndent();
+    builder->appendFormat("goto *%s[%s]", program->targetLabelsVar.c_str(),
+                          program->targetVar.c_str());
+    builder->endOfStatement(true);
+    builder->blockEnd(true);
+    return true;
+}
+
+void StateTranslationVisitor::emitGoto(const FPPTransition* transition, bool fallthrough) {
+    auto program = state->parser->program;
+    if (program->options.instrument)
+        builder->appendFormat("%s[%d]++;%s", program->profileCounters.c_str(), transition->id,
+                              fallthrough ? "" : " ");
+    if (!fallthrough)
+        builder->appendFormat("%sgoto %s;", unrolledExit(transition).c_str(),
+                              target(transition).c_str());
+}
+
+cstring StateTranslationVisitor::target(const FPPTransition* transition) const {
+    auto program = state->parser->program;
+    if (program->suspending && program->isSuspendState(transition->to))
+        return program->suspendLabel(transition->to);
+    if (program->classifying) {
+        cstring edge = program->paths->edgeLabel(state->state->name.name, transition->to);
+        if (edge != nullptr)
+            return edge;
+    }
+    if (loopTarget != nullptr && transition->to == state->state->name.name)
+        return loopTarget;
+    auto variant = program->variant;
+    if (variant != nullptr && transition->to != IR::ParserState::accept &&
+        transition->to != IR::ParserState::reject && !variant->isLive(transition->to))
+        return program->classifying ? program->cutLabel : IR::ParserState::accept;
+    return transition->to;
+}
+
+// Counters incremented by each visit of the state, with their limits:
+// visits of the states that may run any number of times per packet and
+// visits of tunnel states.
+std::vector<std::pair<cstring, unsigned>> StateTranslationVisitor::budgetCounters() const {
+    auto program = state->parser->program;
+    auto& options = program->options;
+    std::vector<std::pair<cstring, unsigned>> counters;
+    if (options.maxVisits != 0 && state->cyclic)
+        counters.emplace_back(program->visitsVar, options.maxVisits);
+    if (options.maxTunnels != 0 && state->state->annotations->getSingle("tunnel") != nullptr)
+        counters.emplace_back(program->tunnelsVar, options.maxTunnels);
+    return counters;
+}
+
+// Statements run when an unrolled copy leaves the unrolled block: the
+// offset is updated once for all the copies run, and the copies after the
+// first count their visits.
+cstring StateTranslationVisitor::unrolledExit(const FPPTransition* transition) const {
+    auto program = state->parser->program;
+    if (loopTarget == nullptr ||
+        (transition->to == state->state->name.name &&
+         iteration + 1 < program->options.unrollDepth))
+        return "";
+    std::string result = std::string(program->offsetVar.c_str()) + " = " +
+                         offsetExpr().c_str() + "; ";
+    for (auto& c : iteration != 0 ? budgetCounters() :
+                   std::vector<std::pair<cstring, unsigned>>())
+        result += std::string(c.first.c_str()) + " += " + std::to_string(iteration) + "; ";
+    return cstring(result);
+}
+
+// The current offset in bits.
+cstring StateTranslationVisitor::offsetExpr() const {
+    if (loopTarget == nullptr)
+        return state->parser->program->offsetVar;
+    return cstring("(") + state->parser->program->unrollBaseVar + " + " +
+           Util::toString(consumed) + ")";
+}
+
+void StateTranslationVisitor::emitAdvance(unsigned bits) {
+    if (loopTarget != nullptr) {
+        consumed += bits;
+        return;
+    }
+    builder->emitIndent();
+    builder->appendFormat("%s += %d", state->parser->program->offsetVar.c_str(), bits);
+    builder->endOfStatement(true);
+}
+
+// Checks the counters and the bytes parsed when a state is entered; the
+// unrolled block checks the same limits for all its copies on entry.
+void StateTranslationVisitor::emitBudgetCheck(const IR::ParserState*) {
+    auto program = state->parser->program;
+    auto& options = program->options;
+    std::vector<cstring> conditions;
+    for (auto& c : budgetCounters())
+        conditions.push_back(cstring("++") + c.first + " > " + Util::toString(c.second));
+    if (options.maxBytes != 0 && state->cyclic)
+        conditions.push_back(cstring("BYTES(") + program->offsetVar + ") > " +
+                             Util::toString(options.maxBytes));
+
+    for (auto c : conditions) {
+        builder->emitIndent();
+        builder->appendFormat("if (__builtin_expect(%s, 0)) { %s = %s; goto %s; }", c.c_str(),
+                              program->errorVar.c_str(), program->parserTimeout.c_str(),
+                              IR::ParserState::reject.c_str());
+        builder->newline();
+    }
+}
+
+// Emits 'unrollDepth' copies of a self-looping state behind one bounds
+// check. The copies read at constant offsets from the offset on entry,
+// which is updated once when the block is left. Each copy continues with
+// the next one, the last one re-enters the state; near the end of the
+// packet or of the parse budget the rolled state below is used, which
+// stops at the exact visit exceeding it.
+void StateTranslationVisitor::emitUnrolled(const IR::ParserState* parserState) {
+    auto program = state->parser->program;
+    auto& options = program->options;
+    unsigned depth = options.unrollDepth;
+    builder->emitIndent();
+    builder->appendFormat("if (%s >= %s + BYTES(%s + %d)", program->packetEndVar.c_str(),
+                          program->packetStartVar.c_str(), program->offsetVar.c_str(),
+                          depth * state->iterationBits);
+    // The first copy was counted by the state.
+    for (auto& c : budgetCounters())
+        builder->appendFormat(" && %s + %d <= %d", c.first.c_str(), depth - 1, c.second);
+    if (options.maxBytes != 0 && state->cyclic)
+        builder->appendFormat(" && BYTES(%s + %d) <= %d", program->offsetVar.c_str(),
+                              (depth - 1) * state->iterationBits, options.maxBytes);
+    builder->append(") ");
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("const uint64_t %s = %s", program->unrollBaseVar.c_str(),
+                          program->offsetVar.c_str());
+    builder->endOfStatement(true);
+    for (unsigned i = 0; i < depth; i++) {
+        StateTranslationVisitor iteration(state);
+        iteration.setBuilder(builder);
+        iteration.setIteration(i, i == 0 ? nullptr : state->unrollLabel(i),
+                               i + 1 < depth ? state->unrollLabel(i + 1) : label);
+        parserState->apply(iteration);
+    }
+    builder->blockEnd(true);
+}
+
 void
 StateTranslationVisitor::compileExtractField(
     const IR::Expression* expr, cstring field, unsigned alignment, FPPType* type) {
@@ -169,7 +758,7 @@ StateTranslationVisitor::compileExtractField(
         builder->appendFormat(")(%s(%s, BYTES(%s))",
                               helper,
                               program->packetStartVar.c_str(),
-                              program->offsetVar.c_str());
+                              offsetExpr().c_str());
         builder->append(")");
         builder->append(")");
         if (shift != 0)
@@ -206,7 +795,7 @@ StateTranslationVisitor::compileExtractField(
             builder->appendFormat(")((%s(%s, BYTES(%s) + %d) >> %d)",
                                   helper,
                                   program->packetStartVar.c_str(),
-                                  program->offsetVar.c_str(), i, shift);
+                                  offsetExpr().c_str(), i, shift);
 
             if ((i == bytes - 1) && (widthToExtract % 8 != 0)) {
                 builder->append(" & FPP_MASK(");
@@ -219,8 +808,121 @@ StateTranslationVisitor::compileExtractField(
         }
     }
 
+    emitAdvance(widthToExtract);
+    builder->newline();
+}
+
+// Adds 'object' of the headers enum member 'type' to the end of the output
+// list; 'object' is freed if the list entry cannot be allocated.
+void StateTranslationVisitor::emitListAppend(cstring object, cstring type) {
+    auto program = state->parser->program;
+    cstring list_type = FPPModel::global("packet_hdr_t");
+    builder->emitIndent();
+    builder->appendFormat("hdr = (%s *) malloc(sizeof(%s));\n", list_type.c_str(),
+                          list_type.c_str());
+    builder->emitIndent();
+    builder->appendFormat("if (hdr == NULL) { free(%s); %s = %s; goto %s; }\n", object.c_str(),
+                          program->errorVar.c_str(), program->outOfMemory.c_str(),
+                          program->endLabel.c_str());
+    builder->emitIndent();
+    builder->appendLine("");
+    builder->emitIndent();
+    builder->appendFormat("hdr->type = %s;\n", type.c_str());
+    builder->emitIndent();
+    builder->appendFormat("hdr->hdr = %s;\n", object.c_str());
+    builder->emitIndent();
+    builder->appendLine("hdr->next = NULL;");
+    builder->appendLine("");
+    builder->emitIndent();
+    builder->appendLine("if (*out == NULL) {");
+    builder->emitIndent();
+    builder->emitIndent();
+    builder->appendLine("*out = hdr;");
+    builder->emitIndent();
+    builder->emitIndent();
+    builder->appendLine("last_hdr = hdr;");
+    builder->emitIndent();
+    builder->appendLine("} else {");
+    builder->emitIndent();
+    builder->emitIndent();
+    builder->appendLine("last_hdr->next = hdr;");
+    builder->emitIndent();
+    builder->emitIndent();
+    builder->appendLine("last_hdr = hdr;");
+    builder->emitIndent();
+    builder->appendLine("}");
+    builder->appendLine("");
+}
+
+// The options of a walked varbit field follow its header in the output
+// list as a separate entry.
+void StateTranslationVisitor::emitTlvWalk(const IR::Expression* expr, cstring field,
+                                          cstring kind) {
+    auto program = state->parser->program;
+    cstring type = FPPTlv::type(kind);
+    builder->emitIndent();
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("struct %s *tlv = (struct %s *) calloc(1, sizeof(struct %s));\n",
+                          type.c_str(), type.c_str(), type.c_str());
+    builder->emitIndent();
+    builder->appendFormat("if (tlv == NULL) { %s = %s; goto %s; }\n",
+                          program->errorVar.c_str(), program->outOfMemory.c_str(),
+                          program->endLabel.c_str());
+    builder->emitIndent();
+    builder->appendFormat("%s(%s + BYTES(", FPPTlv::walker(kind).c_str(),
+                          program->packetStartVar.c_str());
+    visit(expr);
+    builder->appendFormat(".%s.offset), %s + BYTES(", field.c_str(),
+                          program->packetStartVar.c_str());
+    visit(expr);
+    builder->appendFormat(".%s.offset + ", field.c_str());
+    visit(expr);
+    builder->appendFormat(".%s.length), tlv)", field.c_str());
+    builder->endOfStatement(true);
+    emitListAppend("tlv", type);
+    builder->blockEnd(true);
+}
+
+// Checks the length against the maximum of the field and the packet, and
+// records where the field is; 'remaining' bits of fixed fields follow it.
+void
+StateTranslationVisitor::compileExtractVarbit(const IR::Expression* expr, cstring field,
+                                              const FPPVarbitType* type, cstring length,
+                                              unsigned remaining) {
+    auto program = state->parser->program;
+    builder->emitIndent();
+    builder->appendFormat("if (%s > %d) { %s = %s; goto %s; }", length.c_str(), type->maxWidth,
+                          program->errorVar.c_str(),
+                          FPPModel::global(p4lib.headerTooShort.str()).c_str(),
+                          IR::ParserState::reject.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("if (%s < %s + BYTES(%s + %s + %d)", program->packetEndVar.c_str(),
+                          program->packetStartVar.c_str(), program->offsetVar.c_str(),
+                          length.c_str(), remaining);
+    if (program->segmented)
+        builder->appendFormat(" && !%s(segs, nsegs, BYTES(%s), BYTES(%s + %s + %d), %s, &%s, &%s)",
+                              program->segmentWindow.c_str(), program->offsetVar.c_str(),
+                              program->offsetVar.c_str(), length.c_str(), remaining,
+                              program->stitchVar.c_str(), program->packetStartVar.c_str(),
+                              program->packetEndVar.c_str());
+    builder->appendFormat(") { %s = %s; goto %s; }",
+                          program->errorVar.c_str(),
+                          FPPModel::global(p4lib.packetTooShort.str()).c_str(),
+                          IR::ParserState::reject.c_str());
+    builder->newline();
+
+    builder->emitIndent();
+    visit(expr);
+    builder->appendFormat(".%s.offset = %s", field.c_str(), program->offsetVar.c_str());
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    visit(expr);
+    builder->appendFormat(".%s.length = %s", field.c_str(), length.c_str());
+    builder->endOfStatement(true);
     builder->emitIndent();
-    builder->appendFormat("%s += %d", program->offsetVar.c_str(), widthToExtract);
+    builder->appendFormat("%s += %s", program->offsetVar.c_str(), length.c_str());
     builder->endOfStatement(true);
     builder->newline();
 }
@@ -276,7 +978,7 @@ StateTranslationVisitor::compileLookahead(const IR::Type* type) {
         builder->appendFormat(")((%s(%s, BYTES(%s))",
                               helper,
                               program->packetStartVar.c_str(),
-                              program->offsetVar.c_str());
+                              offsetExpr().c_str());
         if (shift != 0)
             builder->appendFormat(" >> %d", shift);
         builder->append(")");
@@ -295,10 +997,46 @@ StateTranslationVisitor::compileLookahead(const IR::Type* type) {
      }
 }
 
+void StateTranslationVisitor::emitBoundsCheck(unsigned width) {
+    auto program = state->parser->program;
+    bool unlikely = state->parser->profile != nullptr;
+    builder->emitIndent();
+    builder->appendFormat("if (%s%s < %s + BYTES(%s + %d)",
+                          unlikely ? "__builtin_expect(" : "",
+                          program->packetEndVar.c_str(),
+                          program->packetStartVar.c_str(),
+                          program->offsetVar.c_str(), width);
+    // Outside the current segment the window is moved before giving up.
+    if (program->segmented)
+        builder->appendFormat(" && !%s(segs, nsegs, BYTES(%s), BYTES(%s + %d), %s, &%s, &%s)",
+                              program->segmentWindow.c_str(), program->offsetVar.c_str(),
+                              program->offsetVar.c_str(), width, program->stitchVar.c_str(),
+                              program->packetStartVar.c_str(), program->packetEndVar.c_str());
+    builder->appendFormat("%s) ", unlikely ? ", 0" : "");
+    builder->blockStart();
+
+    // A header within the wire length was cut off by the capture.
+    builder->emitIndent();
+    if (program->truncating)
+        builder->appendFormat("%s = BYTES(%s + %d) <= wire_len ? %s : %s;",
+                              program->errorVar.c_str(), program->offsetVar.c_str(), width,
+                              program->truncatedError.c_str(),
+                              FPPModel::global(p4lib.packetTooShort.str()).c_str());
+    else
+        builder->appendFormat("%s = %s;", program->errorVar.c_str(),
+                              FPPModel::global(p4lib.packetTooShort.str()).c_str());
+    builder->newline();
+
+    builder->emitIndent();
+    builder->appendFormat("goto %s;", IR::ParserState::reject.c_str());
+    builder->newline();
+    builder->blockEnd(true);
+}
+
 void
 StateTranslationVisitor::compileExtract(const IR::Vector<IR::Argument>* args) {
-    if (args->size() != 1) {
-        ::error("Variable-sized header fields not yet supported %1%", args);
+    if (args->size() != 1 && args->size() != 2) {
+        ::error("%1%: expected one or two arguments", args);
         return;
     }
 
@@ -323,74 +1061,75 @@ StateTranslationVisitor::compileExtract(const IR::Vector<IR::Argument>* args) {
         return;
     }
 
-    unsigned width = ht->width_bits();
-    auto program = state->parser->program;
-    builder->emitIndent();
-    builder->appendFormat("if (%s < %s + BYTES(%s + %d)) ",
-                          program->packetEndVar.c_str(),
-                          program->packetStartVar.c_str(),
-                          program->offsetVar.c_str(), width);
-    builder->blockStart();
-
-    builder->emitIndent();
-    builder->appendFormat("%s = %s;", program->errorVar.c_str(),
-                          p4lib.packetTooShort.str());
-    builder->newline();
+    // The length of a varbit field is evaluated before 'headers' is
+    // redeclared below, as it usually refers to a header extracted earlier.
+    cstring varbitLength = nullptr;
+    if (args->size() == 2) {
+        varbitLength = FPPModel::reserved("varbitLength") + Util::toString(varbits++);
+        builder->emitIndent();
+        builder->appendFormat("uint32_t %s = (uint32_t) (", varbitLength.c_str());
+        visit(args->at(1)->expression);
+        builder->append(")");
+        builder->endOfStatement(true);
+    }
 
-    builder->emitIndent();
-    builder->appendFormat("goto %s;", IR::ParserState::reject.c_str());
-    builder->newline();
-    builder->blockEnd(true);
+    // Fixed-width fields, the varbit field is checked when it is extracted.
+    unsigned width = 0;
+    for (auto f : ht->fields) {
+        if (!f->type->is<IR::Type_Varbits>())
+            width += f->type->width_bits();
+    }
+    if (!speculative)
+        emitBoundsCheck(width);
+    if (state->parser->program->caching)
+        state->parser->program->layoutCache->emitRecord(builder, ht, offsetExpr(),
+                                                        is_headers_type);
+
+    // The filter also evaluates members not kept by the variant.
+    cstring member = is_headers_type ? membr->member.name : cstring();
+
+    // Members not kept by the variant are only needed for transitions.
+    auto variant = state->parser->program->variant;
+    if (is_headers_type && variant != nullptr && !variant->keeps(membr->member.name)) {
+        builder->emitIndent();
+        builder->appendFormat("struct %s headers[1];",
+                              FPPModel::global(type->to<IR::Type_StructLike>()->name.name).c_str());
+        builder->newline();
+        is_headers_type = false;
+    }
 
    if (is_headers_type) {
       cstring hdr_type = type->to<IR::Type_StructLike>()->name.name;
       cstring hdr_name = membr->member.name;
+      cstring hdr_struct = FPPModel::global(hdr_type);
+      auto program = state->parser->program;
 
       builder->emitIndent();
-      builder->appendFormat("struct %s *headers = (struct %s *) malloc(sizeof(struct %s));\n", hdr_type, hdr_type, hdr_type);
-      builder->emitIndent();
-      builder->appendLine("if (headers == NULL) { fpp_errorCode = OutOfMemory; goto fpp_end; }");
+      builder->appendFormat("struct %s *headers = (struct %s *) malloc(sizeof(struct %s));\n", hdr_struct, hdr_struct, hdr_struct);
       builder->emitIndent();
-      builder->appendFormat("hdr = (packet_hdr_t *) malloc(sizeof(packet_hdr_t));\n");
+      builder->appendFormat("if (headers == NULL) { %s = %s; goto %s; }\n",
+                            program->errorVar.c_str(), program->outOfMemory.c_str(),
+                            program->endLabel.c_str());
+      emitListAppend("headers", FPPModel::reserved(hdr_type));
       builder->emitIndent();
-      builder->appendLine("if (hdr == NULL) { free(headers); fpp_errorCode = OutOfMemory; goto fpp_end; }");
-      builder->emitIndent();
-      builder->appendLine("");
-      builder->emitIndent();
-      builder->appendFormat("hdr->type = fpp_%s;\n", hdr_type);
-      builder->emitIndent();
-      builder->appendLine("hdr->hdr = headers;");
-      builder->emitIndent();
-      builder->appendLine("hdr->next = NULL;");
-      builder->appendLine("");
-      builder->emitIndent();
-      builder->appendLine("if (*out == NULL) {");
-      builder->emitIndent();
-      builder->emitIndent();
-      builder->appendLine("*out = hdr;");
-      builder->emitIndent();
-      builder->emitIndent();
-      builder->appendLine("last_hdr = hdr;");
-      builder->emitIndent();
-      builder->appendLine("} else {");
-      builder->emitIndent();
-      builder->emitIndent();
-      builder->appendLine("last_hdr->next = hdr;");
-      builder->emitIndent();
-      builder->emitIndent();
-      builder->appendLine("last_hdr = hdr;");
-      builder->emitIndent();
-      builder->appendLine("}");
-      builder->appendLine("");
-      builder->emitIndent();
-      builder->appendLine("headers->header_offset = fpp_packetOffsetInBits / 8;");
+      builder->appendFormat("headers->header_offset = %s / 8;\n", offsetExpr().c_str());
       builder->appendLine("");
    }
 
     unsigned alignment = 0;
+    unsigned remaining = width;
     for (auto f : ht->fields) {
         auto ftype = state->parser->typeMap->getType(f);
         auto etype = FPPTypeFactory::instance->create(ftype);
+        if (auto vt = etype->to<FPPVarbitType>()) {
+            if (varbitLength == nullptr) {
+                ::error("%1%: a header with a varbit field is extracted with a length", expr);
+                return;
+            }
+            compileExtractVarbit(expr, f->name, vt, varbitLength, remaining);
+            continue;
+        }
+        remaining -= f->type->width_bits();
         auto et = dynamic_cast<IHasWidth*>(etype);
         if (et == nullptr) {
             ::error("Only headers with fixed widths supported %1%", f);
@@ -404,6 +1143,106 @@ StateTranslationVisitor::compileExtract(const IR::Vector<IR::Argument>* args) {
     builder->emitIndent();
     visit(expr);
     builder->appendLine(".header_valid = 1;");
+
+    auto filter = state->parser->program->filter;
+    if (filter != nullptr && !member.isNullOrEmpty())
+        filter->emitExtracted(builder, member, "headers");
+
+    // The structure and the start of the header; the offset has moved past
+    // its fields.
+    auto program = state->parser->program;
+    cstring object = !member.isNullOrEmpty() ? cstring("headers[0]") :
+            expr->is<IR::PathExpression>() ?
+            expr->to<IR::PathExpression>()->path->name.name : cstring();
+    cstring start = cstring("BYTES(") + offsetExpr() + " - " + Util::toString(width);
+    if (varbitLength != nullptr)
+        start = start + " - " + varbitLength;
+    start = start + ")";
+
+    auto checksum = FPPChecksum::kind(ht);
+    if (checksum != nullptr) {
+        if (object.isNullOrEmpty()) {
+            ::error("%1%: cannot verify the checksum of this header", expr);
+            return;
+        }
+        if (!program->segmented) {
+            FPPChecksum::emitVerify(builder, checksum, object, start, program->checksumL3Var);
+        } else if (FPPChecksum::verified(ht)) {
+            builder->emitIndent();
+            builder->appendFormat("%s.checksum_valid = 0;", object.c_str());
+            builder->newline();
+        }
+    }
+
+    std::vector<const FPPFlowKey::Field*> flowFields;
+    if (state->parser->program->flowing)
+        flowFields = state->parser->program->flowKey->fieldsOf(ht->name.name);
+    if (!flowFields.empty()) {
+        builder->emitIndent();
+        builder->append("if (flow != NULL) ");
+        builder->blockStart();
+        for (auto f : flowFields) {
+            builder->emitIndent();
+            if (FPPScalarType::generatesScalar(f->field->type->width_bits())) {
+                builder->appendFormat("flow->key.%s = ", f->member().c_str());
+                visit(expr);
+                builder->appendFormat(".%s", f->field->name.name.c_str());
+            } else {
+                builder->appendFormat("memcpy(flow->key.%s, ", f->member().c_str());
+                visit(expr);
+                builder->appendFormat(".%s, sizeof(flow->key.%s))", f->field->name.name.c_str(),
+                                      f->member().c_str());
+            }
+            builder->endOfStatement(true);
+        }
+        builder->blockEnd(true);
+    }
+
+    if (is_headers_type && state->parser->program->classifying) {
+        builder->emitIndent();
+        builder->appendFormat("%s |= %s(%s);", state->parser->program->headerBitsVar.c_str(),
+                              FPPModel::macro("FPP_HEADER_BIT").c_str(),
+                              FPPModel::reserved(ht->name.name).c_str());
+        builder->newline();
+    }
+
+    if (is_headers_type) {
+        for (auto f : ht->fields) {
+            auto kind = FPPTlv::kind(f);
+            if (kind != nullptr)
+                emitTlvWalk(expr, f->name, kind);
+        }
+    }
+
+    // The transport headers of a fragment other than the first are in
+    // another packet.
+    auto fragment = FPPFragment::kind(ht);
+    if (fragment != nullptr && FPPFragment::flagged(ht)) {
+        if (object.isNullOrEmpty()) {
+            ::error("%1%: cannot check the fragment of this header", expr);
+            return;
+        }
+        // The window of the segmented parser covers the header just extracted.
+        FPPFragment::emitCheck(builder, fragment, object,
+                               program->packetStartVar + " + " + start, program->fragmentedLabel);
+        // The first fragment holds only part of the TCP or UDP segment.
+        if (fragment == "ipv6_frag" && program->checksums && !program->segmented) {
+            builder->emitIndent();
+            builder->appendFormat("if (%s.fragmented) %s |= 8;", object.c_str(),
+                                  program->checksumL3Var.c_str());
+            builder->newline();
+        }
+    }
+
+    if (is_headers_type && state->parser->program->stopping) {
+        builder->emitIndent();
+        builder->appendFormat("if (stop & %s(%s)) goto %s;", FPPModel::macro("FPP_STOP_BIT").c_str(),
+                              FPPModel::reserved(type->to<IR::Type_StructLike>()->name.name).c_str(),
+                              state->parser->program->classifying ?
+                              state->parser->program->cutLabel.c_str() :
+                              IR::ParserState::accept.c_str());
+        builder->newline();
+    }
     return;
 }
 
@@ -439,15 +1278,20 @@ bool StateTranslationVisitor::preorder(const IR::MethodCallExpression* expressio
                return false;
             } else if (extMethod->method->name.name == p4lib.packetIn.advance.name) {
                auto arg = expression->arguments->at(0);
+               // Unrolled loops only advance by constants.
+               if (loopTarget != nullptr) {
+                   emitAdvance(arg->expression->to<IR::Constant>()->asUnsigned());
+                   return false;
+               }
                builder->emitIndent();
-               builder->appendFormat("fpp_packetOffsetInBits += ");
+               builder->appendFormat("%s += ", state->parser->program->offsetVar.c_str());
 
                visit(arg);
 
                builder->append(";\n");
                return false;
             } else if (extMethod->method->name.name == p4lib.packetIn.length.name) {
-               builder->append("packet_len");
+               builder->append(state->parser->program->truncating ? "wire_len" : "packet_len");
                return false;
             }
 
@@ -509,19 +1353,41 @@ void FPPParserState::emit(CodeBuilder* builder) {
     state->apply(visitor);
 }
 
+void FPPParserState::emitSpeculative(CodeBuilder* builder, const FPPTransition* next,
+                                     bool fallthrough) const {
+    StateTranslationVisitor visitor(this);
+    visitor.setBuilder(builder);
+    visitor.setSpeculative(next, fallthrough);
+    state->apply(visitor);
+}
+
+cstring FPPParserState::unrollLabel(unsigned iteration) const {
+    return FPPModel::reserved(state->name.name + "_unroll" + Util::toString(iteration));
+}
+
+void FPPParser::emitExtractFunction(CodeBuilder* builder, const IR::Type_Header* type,
+                                    cstring name) const {
+    StateTranslationVisitor visitor(states.at(0));
+    visitor.setBuilder(builder);
+    visitor.setExtractFunction(name);
+    type->apply(visitor);
+}
+
 FPPParser::FPPParser(const FPPProgram* program, const IR::ParserBlock* block,
                        const P4::TypeMap* typeMap) :
         program(program), typeMap(typeMap), parserBlock(block),
-        packet(nullptr), headers(nullptr), headerType(nullptr) {}
+        profile(nullptr), packet(nullptr), headers(nullptr), headerType(nullptr) {}
 
 void FPPParser::emit(CodeBuilder* builder) {
-    for (auto s : states)
+    for (auto s : layout())
         s->emit(builder);
     builder->newline();
 
     // Create a synthetic reject state
     builder->emitIndent();
-    builder->appendFormat("%s: { return fpp_errorCode; }", IR::ParserState::reject.c_str());
+    builder->appendFormat("%s: { ", IR::ParserState::reject.c_str());
+    program->emitReturn(builder, program->errorVar);
+    builder->append(" }");
     builder->newline();
     builder->newline();
 }
@@ -539,6 +1405,29 @@ bool FPPParser::build() {
     for (auto state : parserBlock->container->states) {
         auto ps = new FPPParserState(state, this);
         states.push_back(ps);
+        addTransitions(ps);
+    }
+
+    bool cyclic = false, tunnels = false;
+    for (auto ps : states) {
+        ps->cyclic = reachesItself(ps);
+        cyclic = cyclic || ps->cyclic;
+        tunnels = tunnels || ps->state->annotations->getSingle("tunnel") != nullptr;
+    }
+    if (!cyclic && (program->options.maxVisits != 0 || program->options.maxBytes != 0))
+        ::warning("Parser has no cycle, every path visits each state at most once");
+    if (!tunnels && program->options.maxTunnels != 0)
+        ::warning("--max-tunnels: no parser state is annotated with @tunnel");
+
+    if (program->options.unrollDepth != 0) {
+        for (auto ps : states)
+            ps->iterationBits = iterationBits(ps);
+    }
+
+    // Fused transitions bypass the counters of the intermediate states.
+    if (program->options.fuseBits != 0 && !program->options.instrument) {
+        for (auto ps : states)
+            ps->fused = FPPFusedSelect::build(ps, program->options.fuseBits);
     }
 
     auto ht = typeMap->getType(headers);
@@ -548,4 +1437,133 @@ bool FPPParser::build() {
     return true;
 }
 
+void FPPParser::addTransitions(FPPParserState* ps) {
+    auto add = [this, ps](cstring to, const IR::SelectCase* selectCase) {
+        auto t = new FPPTransition(transitions.size(), ps->transitions.size(),
+                                   ps, to, selectCase);
+        transitions.push_back(t);
+        ps->transitions.push_back(t);
+    };
+
+    auto select = ps->state->selectExpression;
+    if (ps->state->isBuiltin()) {
+        return;
+    } else if (select == nullptr) {
+        add(IR::ParserState::reject, nullptr);
+    } else if (select->is<IR::PathExpression>()) {
+        add(select->to<IR::PathExpression>()->path->name.name, nullptr);
+    } else if (select->is<IR::SelectExpression>()) {
+        bool hasDefault = false;
+        for (auto c : select->to<IR::SelectExpression>()->selectCases) {
+            add(c->state->path->name.name, c);
+            hasDefault = hasDefault || c->keyset->is<IR::DefaultExpression>();
+        }
+        if (!hasDefault)
+            add(IR::ParserState::reject, nullptr);
+    }
+}
+
+// Paths without a cycle visit every state at most once; only states on a
+// cycle need the runtime visit counter.
+bool FPPParser::reachesItself(const FPPParserState* ps) const {
+    std::set<const FPPParserState*> seen;
+    std::vector<const FPPParserState*> work = { ps };
+    while (!work.empty()) {
+        auto s = work.back();
+        work.pop_back();
+        for (auto t : s->transitions) {
+            auto next = getState(t->to);
+            if (next == ps)
+                return true;
+            if (next != nullptr && seen.insert(next).second)
+                work.push_back(next);
+        }
+    }
+    return false;
+}
+
+// Bits consumed by one iteration of a self-looping state, or 0 if the state
+// does not loop or its components do not consume a constant amount.
+unsigned FPPParser::iterationBits(const FPPParserState* ps) const {
+    bool loops = false;
+    for (auto t : ps->transitions)
+        loops = loops || t->to == ps->state->name.name;
+    if (!loops)
+        return 0;
+
+    auto& p4lib = P4::P4CoreLibrary::instance;
+    unsigned bits = 0;
+    for (auto c : ps->state->components) {
+        if (c->is<IR::AssignmentStatement>())
+            continue;
+        auto mcs = c->to<IR::MethodCallStatement>();
+        if (mcs == nullptr)
+            return 0;
+        auto mi = P4::MethodInstance::resolve(mcs->methodCall, program->refMap, typeMap);
+        auto em = mi->to<P4::ExternMethod>();
+        if (em == nullptr || em->object != packet)
+            return 0;
+
+        auto args = mcs->methodCall->arguments;
+        if (em->method->name.name == p4lib.packetIn.extract.name && args->size() == 1) {
+            auto ht = typeMap->getType(args->at(0)->expression, true)->to<IR::Type_Header>();
+            if (ht == nullptr)
+                return 0;
+            bits += ht->width_bits();
+        } else if (em->method->name.name == p4lib.packetIn.advance.name) {
+            auto amount = args->at(0)->expression->to<IR::Constant>();
+            if (amount == nullptr)
+                return 0;
+            bits += amount->asUnsigned();
+        } else {
+            return 0;
+        }
+    }
+    return bits;
+}
+
+FPPParserState* FPPParser::getState(cstring name) const {
+    for (auto s : states) {
+        if (s->state->name.name == name)
+            return s;
+    }
+    return nullptr;
+}
+
+// Without a profile the states are emitted in source order. With a profile
+// each chain starts at the hottest state not yet placed and follows the
+// hottest transition, so the common path falls through in the output.
+std::vector<FPPParserState*> FPPParser::layout() const {
+    if (profile == nullptr)
+        return states;
+
+    std::vector<FPPParserState*> seeds(states);
+    std::stable_sort(seeds.begin(), seeds.end(),
+                     [this](const FPPParserState* a, const FPPParserState* b) {
+                         return profile->stateVisits(a->state->name.name) >
+                                profile->stateVisits(b->state->name.name); });
+
+    std::vector<FPPParserState*> result;
+    std::set<const FPPParserState*> placed;
+    for (auto seed : seeds) {
+        auto s = seed;
+        while (s != nullptr && placed.count(s) == 0) {
+            result.push_back(s);
+            placed.insert(s);
+
+            FPPParserState* next = nullptr;
+            uint64_t best = 0;
+            for (auto t : s->transitions) {
+                auto succ = getState(t->to);
+                if (succ != nullptr && placed.count(succ) == 0 && profile->count(t) > best) {
+                    best = profile->count(t);
+                    next = succ;
+                }
+            }
+            s = next;
+        }
+    }
+    return result;
+}
+
 }  // namespace FPP
@@ -26,15 +26,48 @@ limitations under the License.
 namespace FPP {
 
 class FPPParser;
+class FPPParserState;
+class FPPProfile;
+class FPPFusedSelect;
+
+// Outgoing edge of a parser state. Transitions are numbered in the order
+// in which they are emitted; a select without a default case gets an
+// implicit default transition to reject.
+class FPPTransition {
+ public:
+    unsigned                id;
+    unsigned                index;  // position among the transitions of 'from'
+    const FPPParserState*   from;
+    cstring                 to;
+    const IR::SelectCase*   selectCase;  // nullptr if not part of a select
+
+    FPPTransition(unsigned id, unsigned index, const FPPParserState* from, cstring to,
+                  const IR::SelectCase* selectCase) :
+            id(id), index(index), from(from), to(to), selectCase(selectCase) {}
+    bool isDefault() const
+    { return selectCase == nullptr || selectCase->keyset->is<IR::DefaultExpression>(); }
+};
 
 class FPPParserState : public FPPObject {
  public:
     const IR::ParserState* state;
     const FPPParser* parser;
+    std::vector<FPPTransition*> transitions;
+    const FPPFusedSelect* fused;
+    // Bits consumed per iteration of an unrolled self-loop, 0 if not unrolled.
+    unsigned iterationBits;
+    // The state can be reached from itself, so it may be visited any
+    // number of times per packet.
+    bool cyclic;
 
     FPPParserState(const IR::ParserState* state, FPPParser* parser) :
-            state(state), parser(parser) {}
+            state(state), parser(parser), fused(nullptr), iterationBits(0), cyclic(false) {}
     void emit(CodeBuilder* builder);
+    // Emits the state inside a speculative straight-line block; 'next' is
+    // the verified outgoing transition or nullptr to evaluate the select.
+    void emitSpeculative(CodeBuilder* builder, const FPPTransition* next,
+                         bool fallthrough) const;
+    cstring unrollLabel(unsigned iteration) const;
 };
 
 class FPPParser : public FPPObject {
@@ -43,6 +76,8 @@ class FPPParser : public FPPObject {
     const P4::TypeMap*            typeMap;
     const IR::ParserBlock*        parserBlock;
     std::vector<FPPParserState*> states;
+    std::vector<FPPTransition*>  transitions;
+    const FPPProfile*            profile;
     const IR::Parameter*          packet;
     const IR::Parameter*          headers;
     FPPType*                     headerType;
@@ -51,6 +86,17 @@ class FPPParser : public FPPObject {
                         const P4::TypeMap* typeMap);
     void emit(CodeBuilder* builder);
     bool build();
+    FPPParserState* getState(cstring name) const;
+    // States in the order in which they are emitted.
+    std::vector<FPPParserState*> layout() const;
+    // Emits a function 'name' extracting a header of 'type' at an offset.
+    void emitExtractFunction(CodeBuilder* builder, const IR::Type_Header* type,
+                             cstring name) const;
+
+ private:
+    void addTransitions(FPPParserState* ps);
+    unsigned iterationBits(const FPPParserState* ps) const;
+    bool reachesItself(const FPPParserState* ps) const;
 };
 
 }  // namespace FPP
@@ -0,0 +1,225 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <algorithm>
+
+#include "fppPaths.h"
+#include "fppModel.h"
+#include "frontends/p4/coreLibrary.h"
+#include "frontends/p4/methodInstance.h"
+
+namespace FPP {
+
+namespace {
+// Paths above this count make the table too large to be useful.
+const unsigned long long maxPaths = 1 << 16;
+}  // namespace
+
+bool FPPPaths::build() {
+    auto start = parser->getState(IR::ParserState::start);
+    if (start == nullptr)
+        return false;
+
+    // Depth-first search finds the back edges and the post order.
+    std::map<const FPPParserState*, int> color;  // 1 on the stack, 2 done
+    std::vector<const FPPParserState*> postOrder;
+    std::vector<std::pair<const FPPParserState*, size_t>> stack = { { start, 0 } };
+    color[start] = 1;
+    while (!stack.empty()) {
+        auto& top = stack.back();
+        auto ps = top.first;
+        if (top.second == ps->transitions.size()) {
+            color[ps] = 2;
+            postOrder.push_back(ps);
+            stack.pop_back();
+            continue;
+        }
+        auto t = ps->transitions.at(top.second++);
+        auto next = parser->getState(t->to);
+        if (next == nullptr)
+            continue;
+        if (color[next] == 1)
+            backEdges.emplace(ps->state->name.name, t->to);
+        else if (color[next] == 0) {
+            color[next] = 1;
+            stack.emplace_back(next, 0);
+        }
+    }
+
+    // Successors of a state are numbered once however many cases lead to
+    // them, so that paths are sequences of states.
+    for (auto ps : postOrder) {
+        cstring name = ps->state->name.name;
+        if (name == IR::ParserState::accept) {
+            numPaths[name] = 1;
+            continue;
+        }
+        unsigned long long sum = 0;
+        for (auto t : ps->transitions) {
+            Edge edge(name, t->to);
+            if (backEdges.count(edge) != 0 || increments.count(edge) != 0)
+                continue;
+            increments[edge] = static_cast<unsigned>(sum);
+            sum += numPaths[t->to];
+            if (sum > maxPaths) {
+                ::error("Parser has more than %1% paths to accept", maxPaths);
+                return false;
+            }
+        }
+        numPaths[name] = sum;
+    }
+
+    if (numPaths[start->state->name.name] == 0) {
+        ::error("Parser has no path to accept");
+        return false;
+    }
+    std::vector<const FPPParserState*> states;
+    enumerate(start, 0, states);
+    std::sort(paths.begin(), paths.end(),
+              [](const Path& a, const Path& b) { return a.id < b.id; });
+    return true;
+}
+
+void FPPPaths::enumerate(const FPPParserState* ps, unsigned id,
+                         std::vector<const FPPParserState*>& states) {
+    cstring name = ps->state->name.name;
+    if (name == IR::ParserState::accept) {
+        paths.push_back({ id, states });
+        return;
+    }
+    states.push_back(ps);
+    std::set<cstring> seen;
+    for (auto t : ps->transitions) {
+        Edge edge(name, t->to);
+        if (backEdges.count(edge) != 0 || !seen.insert(t->to).second)
+            continue;
+        auto next = parser->getState(t->to);
+        if (next != nullptr && numPaths[t->to] != 0)
+            enumerate(next, id + increments.at(edge), states);
+    }
+    states.pop_back();
+}
+
+cstring FPPPaths::edgeLabel(cstring from, cstring to) const {
+    if (from == to)
+        return nullptr;
+    Edge edge(from, to);
+    auto it = increments.find(edge);
+    if (backEdges.count(edge) == 0 && (it == increments.end() || it->second == 0))
+        return nullptr;
+    return FPPModel::reserved("edge_") + from + "_" + to;
+}
+
+std::vector<cstring> FPPPaths::headersOf(const FPPParserState* ps) const {
+    std::vector<cstring> result;
+    auto& p4lib = P4::P4CoreLibrary::instance;
+    for (auto c : ps->state->components) {
+        auto mcs = c->to<IR::MethodCallStatement>();
+        if (mcs == nullptr)
+            continue;
+        auto mi = P4::MethodInstance::resolve(mcs->methodCall, parser->program->refMap,
+                                              parser->program->typeMap);
+        auto em = mi->to<P4::ExternMethod>();
+        if (em == nullptr || em->object != parser->packet ||
+            em->method->name.name != p4lib.packetIn.extract.name)
+            continue;
+        auto expr = mcs->methodCall->arguments->at(0)->expression;
+        auto member = expr->to<IR::Member>();
+        if (member == nullptr || !member->expr->is<IR::PathExpression>() ||
+            member->expr->to<IR::PathExpression>()->path->name.name !=
+            parser->headers->name.name)
+            continue;
+        auto ht = parser->typeMap->getType(expr, true)->to<IR::Type_Header>();
+        if (ht != nullptr)
+            result.push_back(ht->name.name);
+    }
+    return result;
+}
+
+void FPPPaths::emitEdges(CodeBuilder* builder, cstring pathVar, cstring loopedVar) const {
+    std::set<Edge> edges(backEdges);
+    for (auto& i : increments)
+        edges.insert(i.first);
+    for (auto& edge : edges) {
+        cstring label = edgeLabel(edge.first, edge.second);
+        if (label == nullptr)
+            continue;
+        builder->emitIndent();
+        if (backEdges.count(edge) != 0)
+            builder->appendFormat("%s: %s = 1; goto %s;", label.c_str(), loopedVar.c_str(),
+                                  edge.second.c_str());
+        else
+            builder->appendFormat("%s: %s += %u; goto %s;", label.c_str(), pathVar.c_str(),
+                                  increments.at(edge), edge.second.c_str());
+        builder->newline();
+    }
+}
+
+void FPPPaths::emitStep(CodeBuilder* builder, cstring from, cstring to,
+                        cstring pathVar, cstring loopedVar) const {
+    if (edgeLabel(from, to) == nullptr)
+        return;
+    Edge edge(from, to);
+    builder->emitIndent();
+    if (backEdges.count(edge) != 0)
+        builder->appendFormat("%s = 1;", loopedVar.c_str());
+    else
+        builder->appendFormat("%s += %u;", pathVar.c_str(), increments.at(edge));
+    builder->newline();
+}
+
+void FPPPaths::emitTable(CodeBuilder* builder) const {
+    cstring table = FPPModel::reserved("paths");
+    for (auto& p : paths) {
+        std::vector<cstring> headers;
+        for (auto ps : p.states) {
+            for (auto h : headersOf(ps))
+                headers.push_back(h);
+        }
+        if (headers.empty())
+            continue;
+        builder->appendFormat("static const enum %s %s%u[] = { ",
+                              FPPModel::reserved("headers").c_str(), table.c_str(), p.id);
+        for (size_t i = 0; i < headers.size(); i++)
+            builder->appendFormat(i == 0 ? "%s" : ", %s", FPPModel::reserved(headers[i]).c_str());
+        builder->append(" }");
+        builder->endOfStatement(true);
+    }
+
+    builder->newline();
+    builder->appendFormat("const struct %s %s[%u] = ", FPPModel::reserved("path").c_str(),
+                          table.c_str(), static_cast<unsigned>(paths.size()));
+    builder->blockStart();
+    for (auto& p : paths) {
+        std::string states;
+        unsigned count = 0;
+        for (auto ps : p.states) {
+            states += (states.empty() ? "" : " ") + std::string(ps->state->name.name.c_str());
+            count += headersOf(ps).size();
+        }
+        builder->emitIndent();
+        if (count == 0)
+            builder->appendFormat("{ \"%s\", NULL, 0 },", states.c_str());
+        else
+            builder->appendFormat("{ \"%s\", %s%u, %u },", states.c_str(), table.c_str(), p.id,
+                                  count);
+        builder->newline();
+    }
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+}
+
+}  // namespace FPP
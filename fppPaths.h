@@ -0,0 +1,66 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPPATHS_H_
+#define _BACKENDS_FPP_FPPPATHS_H_
+
+#include <map>
+#include <set>
+
+#include "fppParser.h"
+
+namespace FPP {
+
+// Ball-Larus numbering of the paths from start to accept. Each edge
+// between two states gets an increment such that the sums along the
+// accept paths are 0 .. count - 1. Self-loops add nothing, so repeated
+// VLAN tags or MPLS labels do not change the path; other back edges mark
+// the path as looped instead of numbering it.
+class FPPPaths {
+    const FPPParser* parser;
+    typedef std::pair<cstring, cstring> Edge;
+    std::map<Edge, unsigned> increments;
+    std::set<Edge> backEdges;
+    std::map<cstring, unsigned long long> numPaths;
+
+    void enumerate(const FPPParserState* ps, unsigned id,
+                   std::vector<const FPPParserState*>& states);
+
+ public:
+    struct Path {
+        unsigned id;
+        std::vector<const FPPParserState*> states;
+    };
+    std::vector<Path> paths;  // ordered by id
+
+    explicit FPPPaths(const FPPParser* parser) : parser(parser) {}
+    bool build();
+    // Label jumped to instead of the state 'to' to account for the edge,
+    // nullptr if the edge needs no code.
+    cstring edgeLabel(cstring from, cstring to) const;
+    // Header types extracted into the headers structure by a state.
+    std::vector<cstring> headersOf(const FPPParserState* ps) const;
+    void emitEdges(CodeBuilder* builder, cstring pathVar, cstring loopedVar) const;
+    // Accounts for the edge in place, for code that continues at 'to'
+    // without jumping through the edge label.
+    void emitStep(CodeBuilder* builder, cstring from, cstring to,
+                  cstring pathVar, cstring loopedVar) const;
+    void emitTable(CodeBuilder* builder) const;
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPPATHS_H_ */
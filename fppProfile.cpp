@@ -0,0 +1,116 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "lib/error.h"
+#include "fppProfile.h"
+
+namespace FPP {
+
+bool FPPProfile::load(cstring file) {
+    std::ifstream in(file.c_str());
+    if (!in) {
+        ::error("Cannot open profile %1%", file);
+        return false;
+    }
+
+    std::string line;
+    unsigned lineNo = 0;
+    while (std::getline(in, line)) {
+        lineNo++;
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::istringstream fields(line);
+        std::string from, to;
+        unsigned index;
+        uint64_t count;
+        if (!(fields >> from >> index >> to >> count)) {
+            ::error("%1%:%2%: malformed profile line", file, lineNo);
+            return false;
+        }
+
+        auto state = parser->getState(from);
+        if (state == nullptr || index >= state->transitions.size() ||
+            state->transitions[index]->to != to.c_str()) {
+            ::warning("%1%:%2%: transition %3% -> %4% does not match the program, ignored",
+                      file, lineNo, from.c_str(), to.c_str());
+            continue;
+        }
+
+        auto transition = state->transitions[index];
+        counts[transition->id] += count;
+        visits[transition->to] += count;
+        if (state->state->name.name == IR::ParserState::start)
+            visits[IR::ParserState::start] += count;
+        total += count;
+    }
+    return true;
+}
+
+uint64_t FPPProfile::count(const FPPTransition* transition) const {
+    auto it = counts.find(transition->id);
+    return it == counts.end() ? 0 : it->second;
+}
+
+uint64_t FPPProfile::outgoing(const FPPParserState* state) const {
+    uint64_t result = 0;
+    for (auto t : state->transitions)
+        result += count(t);
+    return result;
+}
+
+uint64_t FPPProfile::stateVisits(cstring state) const {
+    auto it = visits.find(state);
+    return it == visits.end() ? 0 : it->second;
+}
+
+bool FPPProfile::isLikely(const FPPTransition* transition) const {
+    uint64_t all = outgoing(transition->from);
+    return all != 0 && count(transition) >= likelyShare * all;
+}
+
+std::vector<const FPPTransition*>
+FPPProfile::hotTransitions(const FPPParserState* state) const {
+    std::vector<const FPPTransition*> result;
+    uint64_t all = outgoing(state);
+    if (all == 0)
+        return result;
+
+    // Reordering is only safe when no two keysets can match the same value.
+    for (auto t : state->transitions) {
+        if (t->isDefault())
+            continue;
+        if (!t->selectCase->keyset->is<IR::Constant>())
+            return result;
+    }
+
+    for (auto t : state->transitions) {
+        if (!t->isDefault() && count(t) >= hotShare * all)
+            result.push_back(t);
+    }
+    std::stable_sort(result.begin(), result.end(),
+                     [this](const FPPTransition* a, const FPPTransition* b) {
+                         return count(a) > count(b); });
+    if (result.size() > maxHot)
+        result.resize(maxHot);
+    return result;
+}
+
+}  // namespace FPP
@@ -0,0 +1,56 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPPROFILE_H_
+#define _BACKENDS_FPP_FPPPROFILE_H_
+
+#include "fppParser.h"
+
+namespace FPP {
+
+// Transition counts recorded by a parser compiled with --instrument.
+// The profile file contains one line per transition:
+//     <state> <transition index> <target state> <count>
+class FPPProfile {
+    const FPPParser* parser;
+    std::map<unsigned, uint64_t> counts;  // indexed by FPPTransition::id
+    std::map<cstring, uint64_t> visits;
+    uint64_t total;
+
+ public:
+    // A transition is moved out of the switch into an if-chain when it
+    // carries at least hotShare of its state's traffic; at most maxHot
+    // transitions per state are moved.
+    static constexpr double hotShare = 0.25;
+    static constexpr double likelyShare = 0.75;
+    static constexpr unsigned maxHot = 3;
+
+    explicit FPPProfile(const FPPParser* parser) : parser(parser), total(0) {}
+    bool load(cstring file);
+
+    uint64_t count(const FPPTransition* transition) const;
+    uint64_t outgoing(const FPPParserState* state) const;
+    uint64_t stateVisits(cstring state) const;
+    bool isCold(cstring state) const
+    { return total != 0 && stateVisits(state) == 0; }
+    bool isLikely(const FPPTransition* transition) const;
+    // Transitions worth testing before the switch, hottest first.
+    std::vector<const FPPTransition*> hotTransitions(const FPPParserState* state) const;
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPPROFILE_H_ */
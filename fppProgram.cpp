@@ -16,6 +16,8 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <algorithm>
+#include <cctype>
 #include <chrono>
 #include <ctime>
 
@@ -23,6 +25,18 @@ limitations under the License.
 #include "fppProgram.h"
 #include "fppType.h"
 #include "fppParser.h"
+#include "fppProfile.h"
+#include "fppFastPath.h"
+#include "fppVariant.h"
+#include "fppTlv.h"
+#include "fppFlowKey.h"
+#include "fppPaths.h"
+#include "fppLayoutCache.h"
+#include "fppFilter.h"
+#include "fppChecksum.h"
+#include "fppRewrite.h"
+#include "fppFragment.h"
+#include "fppFusedSelect.h"
 #include "frontends/p4/coreLibrary.h"
 #include "frontends/common/options.h"
 #include <stdio.h>
@@ -43,6 +57,191 @@ bool FPPProgram::build() {
     if (!success)
         return success;
 
+    if (!options.profileUse.isNullOrEmpty()) {
+        profile = new FPPProfile(parser);
+        if (!profile->load(options.profileUse))
+            return false;
+        parser->profile = profile;
+    }
+
+    // Reports misplaced @tlv annotations before anything is emitted.
+    FPPTlv::kinds(program);
+    checksums = !FPPChecksum::kinds(program).empty();
+    auto fragmentKinds = FPPFragment::kinds(program);
+    fragments = fragmentKinds.count("ipv4") != 0 || fragmentKinds.count("ipv6_frag") != 0;
+    flowKey = FPPFlowKey::build(program, options.flowHash);
+    if (::errorCount() > 0)
+        return false;
+    if (options.classify) {
+        paths = new FPPPaths(parser);
+        if (!paths->build())
+            return false;
+    }
+    filter = FPPFilter::build(parser, options.filter);
+    if (::errorCount() > 0)
+        return false;
+    // A replayed layout skips the extracts evaluating the filter.
+    if (filter != nullptr && options.layoutCache != 0) {
+        ::error("--layout-cache cannot be combined with a filter");
+        return false;
+    }
+    // A replayed layout also skips the fragment checks.
+    if (fragments && options.layoutCache != 0) {
+        ::error("--layout-cache cannot be combined with @fragment headers");
+        return false;
+    }
+    if (options.reassembly != 0 && !fragments) {
+        ::error("--reassembly needs a header annotated with @fragment(\"ipv4\") or "
+                "@fragment(\"ipv6_frag\")");
+        return false;
+    }
+    if (fragmentKinds.count("ipv6_frag") != 0 && fragmentKinds.count("ipv6") == 0) {
+        ::error("@fragment(\"ipv6_frag\") needs the IPv6 header annotated with "
+                "@fragment(\"ipv6\")");
+        return false;
+    }
+    if (options.layoutCache != 0) {
+        layoutCache = new FPPLayoutCache(parser);
+        if (!layoutCache->build())
+            return false;
+    }
+    if (options.rewrite) {
+        rewrite = new FPPRewrite(this);
+        rewrite->build();
+    }
+
+    return buildFastPaths() && buildEntryPoints() && buildVariants() && buildSuspendStates();
+}
+
+// The suspending parser stops before the states listed by --suspend-at or
+// annotated with @suspend; a state's position in 'suspendStates' is its id
+// in the continuation.
+bool FPPProgram::buildSuspendStates() {
+    std::vector<cstring> names(options.suspendAt);
+    for (auto s : parser->states) {
+        if (s->state->annotations->getSingle("suspend") != nullptr)
+            names.push_back(s->state->name.name);
+    }
+
+    for (auto name : names) {
+        auto ps = parser->getState(name);
+        if (ps == nullptr || ps->state->isBuiltin()) {
+            ::error("--suspend-at: no parser state %1%", name);
+            return false;
+        }
+        if (!isSuspendState(name))
+            suspendStates.push_back(ps);
+    }
+    return true;
+}
+
+bool FPPProgram::isSuspendState(cstring state) const {
+    for (auto s : suspendStates) {
+        if (s->state->name.name == state)
+            return true;
+    }
+    return false;
+}
+
+cstring FPPProgram::suspendLabel(cstring state) const {
+    return FPPModel::reserved("suspend_") + state;
+}
+
+bool FPPProgram::buildVariants() {
+    for (auto spec : options.variants) {
+        auto v = FPPVariant::parse(parser, spec);
+        if (v == nullptr)
+            return false;
+        for (auto other : variants) {
+            if (other->name == v->name) {
+                ::error("--variant %1%: duplicate variant name", spec);
+                return false;
+            }
+        }
+        v->build();
+        variants.push_back(v);
+    }
+    return true;
+}
+
+// States annotated with @entry_point("name") get an additional parse
+// function fpp_parse_from_<name> starting at a given byte offset; the name
+// defaults to the state name.
+bool FPPProgram::buildEntryPoints() {
+    for (auto s : parser->states) {
+        auto anno = s->state->annotations->getSingle("entry_point");
+        if (anno == nullptr)
+            continue;
+
+        cstring name = s->state->name.name;
+        if (anno->expr.size() == 1) {
+            auto str = anno->expr.at(0)->to<IR::StringLiteral>();
+            if (str == nullptr) {
+                ::error("%1%: expected a string literal", anno);
+                return false;
+            }
+            name = str->value;
+            for (auto c = name.c_str(); *c != '\0'; c++) {
+                if (!isalnum(static_cast<unsigned char>(*c)) && *c != '_') {
+                    ::error("%1%: entry point name must be a C identifier", anno);
+                    return false;
+                }
+            }
+        } else if (anno->expr.size() > 1) {
+            ::error("%1%: expected at most one argument", anno);
+            return false;
+        }
+
+        for (auto& e : entryPoints) {
+            if (e.first == name) {
+                ::error("%1%: duplicate entry point %2%", anno, name);
+                return false;
+            }
+        }
+        entryPoints.emplace_back(name, s);
+    }
+    return true;
+}
+
+// Fast paths are requested by --fast-path or by annotating the last state
+// of the path with @fast_path.
+bool FPPProgram::buildFastPaths() {
+    std::vector<cstring> terminals(options.fastPaths);
+    for (auto s : parser->states) {
+        if (s->state->annotations->getSingle("fast_path") != nullptr)
+            terminals.push_back(s->state->name.name);
+    }
+
+    for (auto terminal : terminals) {
+        std::vector<const FPPTransition*> path;
+        if (terminal == "profile") {
+            if (profile == nullptr) {
+                ::error("--fast-path profile requires --profile-use");
+                return false;
+            }
+            path = FPPFastPath::hottestPath(parser);
+            if (path.empty())
+                continue;
+            terminal = path.back()->to;
+        } else {
+            auto ps = parser->getState(terminal);
+            if (ps == nullptr || ps->state->isBuiltin()) {
+                ::error("Fast path: no parser state %1%", terminal);
+                return false;
+            }
+            path = FPPFastPath::shortestPath(parser, terminal);
+            if (path.empty() && terminal != IR::ParserState::start) {
+                ::error("Fast path: state %1% is not reachable from start", terminal);
+                return false;
+            }
+        }
+
+        auto fp = new FPPFastPath(parser, fastPaths.size(), terminal);
+        if (fp->build(path))
+            fastPaths.push_back(fp);
+        else
+            ::warning("Fast path to %1%: no state can be parsed speculatively", terminal);
+    }
     return true;
 }
 
@@ -53,38 +252,214 @@ void FPPProgram::emitC(CodeBuilder* builder, cstring header) {
     builder->newline();
 
     builder->target->emitIncludes(builder);
+    if (!suspendStates.empty() || options.segments || flowKey != nullptr ||
+        layoutCache != nullptr || checksums || rewrite != nullptr || options.reassembly != 0)
+        builder->appendLine("#include <string.h>");
+    if (!options.prefix.isNullOrEmpty()) {
+        builder->newline();
+        emitHelpers(builder);
+    }
+
+    if (options.segments) {
+        builder->newline();
+        emitSegmentWindow(builder);
+    }
+    for (auto kind : FPPTlv::kinds(program)) {
+        builder->newline();
+        FPPTlv::emitWalker(builder, kind);
+    }
+    if (flowKey != nullptr) {
+        builder->newline();
+        flowKey->emitHelpers(builder);
+    }
+    if (checksums) {
+        builder->newline();
+        FPPChecksum::emitHelpers(builder, std::find(options.isas.begin(), options.isas.end(),
+                                                    "avx2") != options.isas.end());
+    }
+    if (layoutCache != nullptr) {
+        builder->newline();
+        layoutCache->emitHelpers(builder);
+    }
+    if (rewrite != nullptr) {
+        builder->newline();
+        rewrite->emitFunctions(builder);
+    }
+    if (options.reassembly != 0) {
+        builder->newline();
+        FPPFragment::emitReassembly(builder, this);
+    }
+    if (std::any_of(parser->states.begin(), parser->states.end(),
+                    [](const FPPParserState* ps) { return ps->fused != nullptr; })) {
+        builder->newline();
+        FPPFusedSelect::emitHelpers(builder);
+    }
+
+    if (options.instrument) {
+        builder->newline();
+        builder->appendFormat("uint64_t %s[%u];", profileCounters.c_str(),
+                              static_cast<unsigned>(parser->transitions.size()));
+        builder->newline();
+    }
 
     builder->newline();
+    for (auto fp : fastPaths) {
+        fp->emitMatch(builder);
+        if (builder->target->lanes() > 1)
+            fp->emitLaneMatch(builder);
+    }
+
     builder->emitIndent();
     builder->target->emitCodeSection(builder, functionName);
-    builder->emitIndent();
-    builder->target->emitMain(builder, functionName);
-    builder->blockStart();
+    emitEntryPoint(builder, functionName, FunctionKind::Packet);
+    for (auto v : variants) {
+        variant = v;
+        builder->newline();
+        emitEntryPoint(builder, v->function(), FunctionKind::Packet);
+        variant = nullptr;
+    }
+    if (options.stopMask) {
+        stopping = true;
+        builder->newline();
+        emitEntryPoint(builder, untilFunction, FunctionKind::Until);
+        stopping = false;
+    }
+    if (options.truncation) {
+        truncating = true;
+        builder->newline();
+        emitEntryPoint(builder, truncatedFunction, FunctionKind::Truncated);
+        truncating = false;
+    }
+    for (auto& e : entryPoints) {
+        entryState = e.second;
+        builder->newline();
+        emitEntryPoint(builder, entryFunction(e.first), FunctionKind::From);
+        entryState = nullptr;
+    }
+    if (layoutCache != nullptr) {
+        caching = true;
+        builder->newline();
+        emitEntryPoint(builder, cachedFunction, FunctionKind::Cached);
+        caching = false;
+    }
+    if (options.segments) {
+        segmented = true;
+        builder->newline();
+        emitEntryPoint(builder, segmentsFunction, FunctionKind::Segments);
+        segmented = false;
+    }
+    if (!suspendStates.empty()) {
+        suspending = true;
+        builder->newline();
+        emitEntryPoint(builder, suspendFunction, FunctionKind::Suspend);
+        suspending = false;
+        resuming = true;
+        builder->newline();
+        emitEntryPoint(builder, resumeFunction, FunctionKind::Resume);
+        resuming = false;
+    }
 
+    builder->newline();
+    builder->appendLine("#ifndef FPP_PREFETCH_DISTANCE");
+    builder->appendLine("#define FPP_PREFETCH_DISTANCE 4");
+    builder->appendLine("#endif");
+    builder->newline();
+    emitEntryPoint(builder, burstFunction, FunctionKind::Burst);
+
+    if (!variants.empty())
+        emitVariantTable(builder);
+    if (paths != nullptr) {
+        builder->newline();
+        paths->emitTable(builder);
+    }
+    if (options.instrument)
+        emitProfileDump(builder);
+
+    builder->target->emitLicense(builder, license);
+}
+
+// Emits the state machine parsing 'packet' of 'packet_len' bytes into 'out'.
+void FPPProgram::emitParserBody(CodeBuilder* builder) {
    //builder->appendLine("void *headers = NULL;");
     builder->emitIndent();
-    builder->appendLine("packet_hdr_t *last_hdr = NULL;");
+    builder->appendFormat("%s *last_hdr = NULL;\n", headerListType.c_str());
     builder->emitIndent();
-    builder->appendLine("packet_hdr_t *hdr = NULL;");
+    builder->appendFormat("%s *hdr = NULL;\n", headerListType.c_str());
     //emitHeaderInstances(builder);
    // builder->append(" = NULL");
     //parser->headerType->emitInitializer(builder);
    // builder->endOfStatement(true);
 
+    if (segmented) {
+        // The window [packetStart + BYTES(offset), packetEnd) is a segment
+        // or the stitch buffer; it is moved when a header does not fit.
+        builder->emitIndent();
+        builder->appendFormat("uint8_t %s[FPP_STITCH_SIZE]", stitchVar.c_str());
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->append("uint32_t packet_len = 0");
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->append("for (uint32_t i = 0; i < nsegs; i++) packet_len += segs[i].iov_len;");
+        builder->newline();
+        builder->emitIndent();
+        builder->append("(void) packet_len");
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("const uint8_t *%s = %s", packetStartVar, stitchVar.c_str());
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("const uint8_t *%s = %s", packetEndVar, stitchVar.c_str());
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("%s(segs, nsegs, 0, 0, %s, &%s, &%s)", segmentWindow.c_str(),
+                              stitchVar.c_str(), packetStartVar.c_str(),
+                              packetEndVar.c_str());
+        builder->endOfStatement(true);
+    } else {
+        builder->emitIndent();
+        builder->appendFormat("const uint8_t *%s = packet", packetStartVar);
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("const uint8_t *%s = packet + packet_len", packetEndVar);
+        builder->endOfStatement(true);
+    }
     builder->emitIndent();
-    builder->appendFormat("const uint8_t *%s = packet", packetStartVar);
-    builder->endOfStatement(true);
-    builder->emitIndent();
-    builder->appendFormat("const uint8_t *%s = packet + packet_len", packetEndVar);
-    builder->endOfStatement(true);
-    builder->emitIndent();
-    builder->appendFormat("uint64_t %s = 0", offsetVar);
+    if (entryState != nullptr)
+        builder->appendFormat("uint64_t %s = (uint64_t) offset * 8", offsetVar);
+    else if (resuming)
+        builder->appendFormat("uint64_t %s = cont->offset", offsetVar);
+    else
+        builder->appendFormat("uint64_t %s = 0", offsetVar);
     builder->endOfStatement(true);
     builder->emitIndent();
-    builder->appendFormat("enum fpp_errorCodes %s = ParserDefaultReject", errorVar);
+    builder->appendFormat("enum %s %s = %s", errorEnum.c_str(), errorVar.c_str(),
+                          defaultReject.c_str());
     builder->endOfStatement(true);
 
     emitLocalVariables(builder);
+    if (options.maxVisits != 0) {
+        builder->emitIndent();
+        builder->appendFormat("unsigned %s = 0", visitsVar.c_str());
+        builder->endOfStatement(true);
+    }
+    if (options.maxTunnels != 0) {
+        builder->emitIndent();
+        builder->appendFormat("unsigned %s = 0", tunnelsVar.c_str());
+        builder->endOfStatement(true);
+    }
+    if (filter != nullptr)
+        filter->emitLocals(builder);
+    // The segmented parser has no contiguous packet to verify checksums on.
+    if (checksums && !segmented) {
+        builder->emitIndent();
+        builder->appendFormat("uint64_t %s = %s", checksumL3Var.c_str(),
+                              resuming ? "cont->checksumL3" : "0");
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("(void) %s", checksumL3Var.c_str());
+        builder->endOfStatement(true);
+    }
     builder->newline();
 
     for (auto loc : parser->parserBlock->container->parserLocals)
@@ -111,30 +486,565 @@ void FPPProgram::emitC(CodeBuilder* builder, cstring header) {
        builder->emitIndent();
        builder->appendFormat("(void) %s", loc->name.name.c_str());
        builder->endOfStatement(true);
+       if (resuming) {
+           builder->emitIndent();
+           builder->appendFormat("memcpy(&%s, &cont->%s, sizeof(%s))", loc->name.name.c_str(),
+                                 loc->name.name.c_str(), loc->name.name.c_str());
+           builder->endOfStatement(true);
+       }
     }
 
     builder->newline();
     builder->emitIndent();
     builder->append("*out = NULL");
     builder->endOfStatement(true);
+    if (classifying) {
+        builder->emitIndent();
+        builder->appendFormat("uint64_t %s = 0", headerBitsVar.c_str());
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("uint32_t %s = 0", pathIdVar.c_str());
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("uint32_t %s = 0", loopedVar.c_str());
+        builder->endOfStatement(true);
+    }
+    if (flowing) {
+        builder->emitIndent();
+        builder->append("if (flow != NULL) memset(&flow->key, 0, sizeof(flow->key))");
+        builder->endOfStatement(true);
+    }
+    if (caching) {
+        builder->newline();
+        layoutCache->emitLookup(builder);
+        builder->emitIndent();
+        builder->appendFormat("struct %s %s", FPPModel::reserved("layout").c_str(),
+                              recordVar.c_str());
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("memset(&%s, 0, sizeof(%s))", recordVar.c_str(),
+                              recordVar.c_str());
+        builder->endOfStatement(true);
+    }
 
+    // Fast paths are verified from the start of the packet and extract
+    // all headers.
+    bool useFastPaths = entryState == nullptr && variant == nullptr &&
+                        !suspending && !resuming && !segmented && !caching;
     builder->newline();
-    builder->emitIndent();
-    builder->appendFormat("goto %s;", IR::ParserState::start.c_str());
-    builder->newline();
+    for (auto fp : useFastPaths ? fastPaths : std::vector<FPPFastPath*>()) {
+        builder->emitIndent();
+        if (burst && builder->target->lanes() > 1)
+            builder->appendFormat("if ((%s%d >> (%s %% %d)) & 1) goto %s;",
+                                  laneMatchVar.c_str(), fp->id, burstIndexVar.c_str(),
+                                  builder->target->lanes(), fp->label().c_str());
+        else
+            builder->appendFormat("if (%s(packet, packet_len)) goto %s;",
+                                  fp->matchFunction().c_str(), fp->label().c_str());
+        builder->newline();
+    }
+    if (resuming) {
+        emitResumeDispatch(builder);
+    } else {
+        builder->emitIndent();
+        builder->appendFormat("goto %s;", entryState != nullptr ?
+                              entryState->state->name.name.c_str() :
+                              IR::ParserState::start.c_str());
+        builder->newline();
+    }
 
+    if (useFastPaths) {
+        for (auto fp : fastPaths)
+            fp->emit(builder);
+    }
     parser->emit(builder);
     emitAcceptState(builder);
+    if (filter != nullptr) {
+        builder->emitIndent();
+        builder->appendFormat("%s: { ", filteredLabel.c_str());
+        emitReturn(builder, filteredError);
+        builder->append(" }");
+        builder->newline();
+    }
+    if (fragments) {
+        builder->emitIndent();
+        builder->appendFormat("%s: { ", fragmentedLabel.c_str());
+        emitReturn(builder, fragmentedError);
+        builder->append(" }");
+        builder->newline();
+    }
+    if (suspending)
+        emitSuspendStates(builder);
+    if (classifying) {
+        paths->emitEdges(builder, pathIdVar, loopedVar);
+        // A variant or a stop header ends the path before it reaches accept.
+        if (variant != nullptr || stopping) {
+            builder->emitIndent();
+            builder->appendFormat("%s: __attribute__((unused)); %s = 1; goto %s;",
+                                  cutLabel.c_str(), loopedVar.c_str(),
+                                  IR::ParserState::accept.c_str());
+            builder->newline();
+        }
+    }
 
     builder->emitIndent();
     builder->append(endLabel); // TODO end of function/ return code
     builder->appendLine(":");
     builder->emitIndent();
-    builder->appendLine("return fpp_errorCode");
-    builder->appendLine(";");
+    emitReturn(builder, errorVar);
+    builder->newline();
+}
+
+// Emits the function 'name', or with --multiversion a copy of it for each
+// instruction set and an ifunc resolving 'name' to the best copy for the
+// host once at load time.
+void FPPProgram::emitEntryPoint(CodeBuilder* builder, cstring name, FunctionKind kind) {
+    if (options.isas.empty()) {
+        emitFunction(builder, name, kind);
+        return;
+    }
+
+    for (auto isa : options.isas) {
+        builder->appendFormat("__attribute__((target(\"%s\"))) static", isa.c_str());
+        builder->newline();
+        emitFunction(builder, cloneName(name, isa), kind);
+        builder->newline();
+    }
+    builder->append("static");
+    builder->newline();
+    emitFunction(builder, cloneName(name, "default"), kind);
+    builder->newline();
+
+    cstring resolver = name + "_resolve";
+    builder->appendFormat("static __typeof__(%s) *%s(void)", name.c_str(), resolver.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("__builtin_cpu_init()");
+    builder->endOfStatement(true);
+    for (auto it = options.isas.rbegin(); it != options.isas.rend(); ++it) {
+        builder->emitIndent();
+        builder->appendFormat("if (__builtin_cpu_supports(\"%s\")) return %s;",
+                              it->c_str(), cloneName(name, *it).c_str());
+        builder->newline();
+    }
+    builder->emitIndent();
+    builder->appendFormat("return %s;", cloneName(name, "default").c_str());
+    builder->newline();
+    builder->blockEnd(true);
+
+    emitSignature(builder, name, kind);
+    builder->appendFormat(" __attribute__((ifunc(\"%s\")))", resolver.c_str());
+    builder->endOfStatement(true);
+}
+
+cstring FPPProgram::entryFunction(cstring name) const {
+    return FPPModel::reserved("parse_from_") + name;
+}
+
+cstring FPPProgram::cloneName(cstring name, cstring isa) const {
+    std::string suffix = isa.c_str();
+    std::replace_if(suffix.begin(), suffix.end(),
+                    [](char c) { return !isalnum(static_cast<unsigned char>(c)); }, '_');
+    return name + "_" + suffix;
+}
+
+void FPPProgram::emitSignature(CodeBuilder* builder, cstring name, FunctionKind kind) const {
+    switch (kind) {
+        case FunctionKind::Packet:
+            builder->target->emitMain(builder, name, outputParams(kind));
+            break;
+        case FunctionKind::Burst:
+            builder->target->emitBurst(builder, name, outputParams(kind));
+            break;
+        case FunctionKind::From:
+            builder->target->emitFrom(builder, name);
+            break;
+        case FunctionKind::Until:
+            builder->target->emitUntil(builder, name, outputParams(kind));
+            break;
+        case FunctionKind::Truncated:
+            builder->target->emitTruncated(builder, name, outputParams(kind));
+            break;
+        case FunctionKind::Segments:
+            builder->target->emitSegments(builder, name, outputParams(kind));
+            break;
+        case FunctionKind::Suspend:
+            builder->target->emitSuspend(builder, name, continuationType);
+            break;
+        case FunctionKind::Resume:
+            builder->target->emitResume(builder, name, continuationType);
+            break;
+        case FunctionKind::Cached:
+            builder->target->emitCached(builder, name, cacheType);
+            break;
+    }
+}
+
+// The parsers which run the state machine from the start of the packet
+// take the optional outputs; they are filled when not NULL.
+bool FPPProgram::hasOutputs(FunctionKind kind) const {
+    return kind == FunctionKind::Packet || kind == FunctionKind::Burst ||
+           kind == FunctionKind::Until || kind == FunctionKind::Truncated ||
+           kind == FunctionKind::Segments;
+}
+
+cstring FPPProgram::outputParams(FunctionKind kind) const {
+    std::string params;
+    if (!hasOutputs(kind))
+        return "";
+    if (flowKey != nullptr)
+        params += std::string(", struct ") + flowType.c_str() +
+                  (kind == FunctionKind::Burst ? " *flows" : " *flow");
+    if (paths != nullptr)
+        params += std::string(", struct ") + classType.c_str() +
+                  (kind == FunctionKind::Burst ? " *classes" : " *cls");
+    return cstring(params);
+}
+
+void FPPProgram::emitFunction(CodeBuilder* builder, cstring name, FunctionKind kind) {
+    flowing = flowKey != nullptr && hasOutputs(kind);
+    classifying = paths != nullptr && hasOutputs(kind);
+    builder->emitIndent();
+    emitSignature(builder, name, kind);
+    builder->blockStart();
+    if (kind == FunctionKind::Burst)
+        emitBurstBody(builder);
+    else
+        emitParserBody(builder);
     builder->blockEnd(true);  // end of function
+    flowing = false;
+    classifying = false;
+}
 
-    builder->target->emitLicense(builder, license);
+// The burst function runs the parser body in a loop; the packet a few
+// iterations ahead is prefetched while the current one is parsed.
+void FPPProgram::emitBurstBody(CodeBuilder* builder) {
+    unsigned lanes = builder->target->lanes();
+    if (lanes > 1) {
+        for (auto fp : fastPaths) {
+            builder->emitIndent();
+            builder->appendFormat("unsigned %s%d = 0", laneMatchVar.c_str(), fp->id);
+            builder->endOfStatement(true);
+        }
+    }
+    builder->emitIndent();
+    builder->appendFormat("for (uint32_t %s = 0; %s < n; %s++) ", burstIndexVar.c_str(),
+                          burstIndexVar.c_str(), burstIndexVar.c_str());
+    builder->blockStart();
+    if (lanes > 1 && !fastPaths.empty())
+        emitLaneMatch(builder);
+    builder->emitIndent();
+    builder->appendFormat("if (%s + FPP_PREFETCH_DISTANCE < n) ", burstIndexVar.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("__builtin_prefetch(packets[%s + FPP_PREFETCH_DISTANCE])",
+                          burstIndexVar.c_str());
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("__builtin_prefetch(packets[%s + FPP_PREFETCH_DISTANCE] + 64)",
+                          burstIndexVar.c_str());
+    builder->endOfStatement(true);
+    builder->blockEnd(true);
+    builder->newline();
+
+    builder->emitIndent();
+    builder->appendFormat("const uint8_t *packet = packets[%s]", burstIndexVar.c_str());
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("uint32_t packet_len = lens[%s]", burstIndexVar.c_str());
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("%s **out = &outs[%s]", headerListType.c_str(),
+                          burstIndexVar.c_str());
+    builder->endOfStatement(true);
+    if (flowing) {
+        builder->emitIndent();
+        builder->appendFormat("struct %s *flow = flows != NULL ? &flows[%s] : NULL",
+                              flowType.c_str(), burstIndexVar.c_str());
+        builder->endOfStatement(true);
+    }
+    if (classifying) {
+        builder->emitIndent();
+        builder->appendFormat("struct %s *cls = classes != NULL ? &classes[%s] : NULL",
+                              classType.c_str(), burstIndexVar.c_str());
+        builder->endOfStatement(true);
+    }
+    builder->newline();
+
+    burst = true;
+    emitParserBody(builder);
+    burst = false;
+    builder->blockEnd(true);
+}
+
+// Fast paths of the next 'lanes' packets are verified together; the tail
+// of the burst is verified one packet at a time.
+void FPPProgram::emitLaneMatch(CodeBuilder* builder) {
+    unsigned lanes = builder->target->lanes();
+    auto index = burstIndexVar.c_str();
+    builder->emitIndent();
+    builder->appendFormat("if (%s %% %d == 0) ", index, lanes);
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("if (%s + %d <= n) ", index, lanes);
+    builder->blockStart();
+    for (auto fp : fastPaths) {
+        builder->emitIndent();
+        builder->appendFormat("%s%d = %s(packets + %s, lens + %s)", laneMatchVar.c_str(),
+                              fp->id, fp->laneMatchFunction().c_str(), index, index);
+        builder->endOfStatement(true);
+    }
+    builder->blockEnd(false);
+    builder->append(" else ");
+    builder->blockStart();
+    for (auto fp : fastPaths) {
+        builder->emitIndent();
+        builder->appendFormat("%s%d = 0", laneMatchVar.c_str(), fp->id);
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("for (uint32_t j = 0; %s + j < n; j++)", index);
+        builder->newline();
+        builder->increaseIndent();
+        builder->emitIndent();
+        builder->appendFormat("%s%d |= (unsigned) %s(packets[%s + j], lens[%s + j]) << j",
+                              laneMatchVar.c_str(), fp->id, fp->matchFunction().c_str(),
+                              index, index);
+        builder->endOfStatement(true);
+        builder->decreaseIndent();
+    }
+    builder->blockEnd(true);
+    builder->blockEnd(true);
+}
+
+// Each suspend state saves the offset and the parser locals before it is
+// entered; the headers parsed so far are already linked into 'out'.
+void FPPProgram::emitSuspendStates(CodeBuilder* builder) {
+    for (size_t i = 0; i < suspendStates.size(); i++) {
+        builder->emitIndent();
+        builder->appendFormat("%s:", suspendLabel(suspendStates[i]->state->name.name).c_str());
+        builder->newline();
+        builder->emitIndent();
+        builder->blockStart();
+        builder->emitIndent();
+        builder->appendFormat("cont->state = %u", static_cast<unsigned>(i));
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("cont->offset = %s", offsetVar.c_str());
+        builder->endOfStatement(true);
+        for (auto loc : parser->parserBlock->container->parserLocals) {
+            auto decl = loc->to<IR::Declaration_Variable>();
+            if (decl == nullptr || FPPTypeFactory::instance->create(decl->type) == nullptr)
+                continue;
+            auto name = loc->name.name.c_str();
+            builder->emitIndent();
+            builder->appendFormat("memcpy(&cont->%s, &%s, sizeof(%s))", name, name, name);
+            builder->endOfStatement(true);
+        }
+        if (filter != nullptr) {
+            builder->emitIndent();
+            builder->appendFormat("cont->filterSeen = %s", filterSeenVar.c_str());
+            builder->endOfStatement(true);
+            builder->emitIndent();
+            builder->appendFormat("cont->filterMatched = %s", filterMatchedVar.c_str());
+            builder->endOfStatement(true);
+        }
+        if (checksums) {
+            builder->emitIndent();
+            builder->appendFormat("cont->checksumL3 = %s", checksumL3Var.c_str());
+            builder->endOfStatement(true);
+        }
+        builder->emitIndent();
+        emitReturn(builder, suspendedError);
+        builder->newline();
+        builder->blockEnd(true);
+    }
+}
+
+void FPPProgram::emitResumeDispatch(CodeBuilder* builder) {
+    builder->emitIndent();
+    builder->append("switch (cont->state) ");
+    builder->blockStart();
+    for (size_t i = 0; i < suspendStates.size(); i++) {
+        builder->emitIndent();
+        builder->appendFormat("case %u: goto %s;", static_cast<unsigned>(i),
+                              suspendStates[i]->state->name.name.c_str());
+        builder->newline();
+    }
+    builder->emitIndent();
+    builder->appendFormat("default: goto %s;", IR::ParserState::reject.c_str());
+    builder->newline();
+    builder->blockEnd(true);
+}
+
+// Points the window at the bytes [from, to) of a segmented packet: at the
+// segment holding them, or at a copy in the stitch buffer when they cross a
+// segment boundary. Returns 0 if the packet ends before 'to'.
+void FPPProgram::emitSegmentWindow(CodeBuilder* builder) {
+    builder->appendLine("#ifndef FPP_STITCH_SIZE");
+    builder->appendLine("#define FPP_STITCH_SIZE 256");
+    builder->appendLine("#endif");
+    builder->newline();
+    builder->appendFormat("static int %s(const struct iovec *segs, uint32_t nsegs, "
+                          "uint64_t from, uint64_t to, uint8_t *stitch, "
+                          "const uint8_t **start, const uint8_t **end)", segmentWindow.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    uint64_t base = 0;");
+    builder->appendLine("    uint32_t i = 0;");
+    builder->appendLine("    while (i < nsegs && base + segs[i].iov_len <= from)");
+    builder->appendLine("        base += segs[i++].iov_len;");
+    builder->appendLine("    if (i < nsegs && to <= base + segs[i].iov_len) {");
+    builder->appendLine("        *start = (const uint8_t *) segs[i].iov_base - base;");
+    builder->appendLine("        *end = (const uint8_t *) segs[i].iov_base + segs[i].iov_len;");
+    builder->appendLine("        return 1;");
+    builder->appendLine("    }");
+    builder->newline();
+    builder->appendLine("    uint64_t n = 0, skip = from - base;");
+    builder->appendLine("    for (; i < nsegs && n < FPP_STITCH_SIZE; i++, skip = 0) {");
+    builder->appendLine("        uint64_t len = segs[i].iov_len - skip;");
+    builder->appendLine("        if (len > FPP_STITCH_SIZE - n)");
+    builder->appendLine("            len = FPP_STITCH_SIZE - n;");
+    builder->appendLine("        memcpy(stitch + n, (const uint8_t *) segs[i].iov_base + skip, len);");
+    builder->appendLine("        n += len;");
+    builder->appendLine("    }");
+    builder->appendLine("    *start = stitch - from;");
+    builder->appendLine("    *end = stitch + n;");
+    builder->appendLine("    return to <= from + n;");
+    builder->blockEnd(true);
+}
+
+// 'path' indexes the path table unless 'looped' is set; 'headers' has the
+// bit of each extracted header type below 64.
+void FPPProgram::emitClassTypes(CodeBuilder* builder) {
+    builder->appendFormat("#define %s(type) ((type) < 64 ? 1ULL << (type) : 0)\n",
+                          FPPModel::macro("FPP_HEADER_BIT").c_str());
+    builder->appendFormat("struct %s ", classType.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("uint64_t headers");
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->append("uint32_t path");
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->append("uint32_t looped");
+    builder->endOfStatement(true);
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+
+    cstring pathType = FPPModel::reserved("path");
+    builder->appendFormat("struct %s ", pathType.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("const char *states");
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->appendFormat("const enum %s *headers", headersEnum.c_str());
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->append("unsigned count");
+    builder->endOfStatement(true);
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->appendFormat("extern const struct %s %s[%u];", pathType.c_str(),
+                          FPPModel::reserved("paths").c_str(),
+                          static_cast<unsigned>(paths->paths.size()));
+    builder->newline();
+}
+
+// The continuation holds everything the parser needs besides the packet:
+// the state to enter, the offset and the values of the parser locals.
+void FPPProgram::emitContinuation(CodeBuilder* builder) {
+    builder->appendFormat("struct %s ", continuationType.c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("uint32_t state");
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->append("uint64_t offset");
+    builder->endOfStatement(true);
+    if (filter != nullptr) {
+        builder->emitIndent();
+        builder->append("uint64_t filterSeen, filterMatched");
+        builder->endOfStatement(true);
+    }
+    if (checksums) {
+        builder->emitIndent();
+        builder->append("uint64_t checksumL3");
+        builder->endOfStatement(true);
+    }
+    for (auto loc : parser->parserBlock->container->parserLocals) {
+        auto decl = loc->to<IR::Declaration_Variable>();
+        if (decl == nullptr)
+            continue;
+        auto type = FPPTypeFactory::instance->create(decl->type);
+        if (type == nullptr)
+            continue;
+        builder->emitIndent();
+        type->declare(builder, loc->name.name, false);
+        builder->endOfStatement(true);
+    }
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+}
+
+// The outputs are complete only when the parser returns.
+void FPPProgram::emitReturn(CodeBuilder* builder, cstring code) const {
+    bool outputs = flowing || classifying;
+    if (burst || outputs)
+        builder->append("{ ");
+    if (flowing) {
+        builder->append("if (flow != NULL) ");
+        flowKey->emitHash(builder, "flow");
+        builder->append(" ");
+    }
+    if (classifying)
+        builder->appendFormat("if (cls != NULL) { cls->headers = %s; cls->path = %s; "
+                              "cls->looped = %s; } ", headerBitsVar.c_str(),
+                              pathIdVar.c_str(), loopedVar.c_str());
+    if (burst)
+        builder->appendFormat("results[%s] = %s; continue; }", burstIndexVar.c_str(),
+                              code.c_str());
+    else if (outputs)
+        builder->appendFormat("return %s; }", code.c_str());
+    else
+        builder->appendFormat("return %s;", code.c_str());
+}
+
+// Lets applications select a variant by name at runtime; the full parser
+// is the first entry.
+void FPPProgram::emitVariantTable(CodeBuilder* builder) {
+    builder->newline();
+    builder->appendFormat("const struct %s %s[%u] = ", variantTable.c_str(),
+                          variantTable.c_str(), static_cast<unsigned>(variants.size() + 1));
+    builder->blockStart();
+    builder->emitIndent();
+    builder->appendFormat("{ \"full\", %s },", functionName.c_str());
+    builder->newline();
+    for (auto v : variants) {
+        builder->emitIndent();
+        builder->appendFormat("{ \"%s\", %s },", v->name.c_str(), v->function().c_str());
+        builder->newline();
+    }
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+}
+
+void FPPProgram::emitProfileDump(CodeBuilder* builder) {
+    builder->newline();
+    builder->appendFormat("void %s(FILE *file)", profileDump.c_str());
+    builder->blockStart();
+    for (auto t : parser->transitions) {
+        builder->emitIndent();
+        builder->appendFormat("fprintf(file, \"%s %d %s %%llu\\n\", "
+                              "(unsigned long long) %s[%d]);",
+                              t->from->state->name.name.c_str(), t->index, t->to.c_str(),
+                              profileCounters.c_str(), t->id);
+        builder->newline();
+    }
+    builder->blockEnd(true);
 }
 
 void FPPProgram::emitGeneratedComment(CodeBuilder* builder) {
@@ -152,38 +1062,129 @@ void FPPProgram::emitGeneratedComment(CodeBuilder* builder) {
 
 void FPPProgram::emitH(CodeBuilder* builder, cstring) {
     emitGeneratedComment(builder);
-    builder->appendLine("#ifndef _P4_GEN_HEADER_");
-    builder->appendLine("#define _P4_GEN_HEADER_");
+    cstring guard = FPPModel::macro("_P4_GEN_HEADER_");
+    builder->appendFormat("#ifndef %s\n", guard.c_str());
+    builder->appendFormat("#define %s\n", guard.c_str());
     builder->target->emitIncludes(builder);
+    if (options.instrument)
+        builder->appendLine("#include <stdio.h>");
+    if (options.segments)
+        builder->appendLine("#include <sys/uio.h>");
     builder->newline();
 
    emitPreamble(builder);
     emitTypes(builder);
 
-    builder->append("typedef struct packet_hdr_s ");
+    builder->appendFormat("typedef struct %s ", headerListStruct.c_str());
     builder->blockStart();
     builder->emitIndent();
-    builder->appendLine("enum fpp_headers type;");
+    builder->appendFormat("enum %s type;\n", headersEnum.c_str());
     builder->emitIndent();
     builder->appendLine("void *hdr;");
     builder->emitIndent();
-    builder->appendLine("struct packet_hdr_s *next;");
+    builder->appendFormat("struct %s *next;\n", headerListStruct.c_str());
     builder->blockEnd(true);
-    builder->append("packet_hdr_t");
+    builder->append(headerListType);
     builder->endOfStatement(true);
     builder->newline();
 
-    builder->target->emitMain(builder, functionName);
+    if (paths != nullptr) {
+        emitClassTypes(builder);
+        builder->newline();
+    }
+    builder->target->emitMain(builder, functionName, outputParams(FunctionKind::Packet));
+    builder->endOfStatement(true);
+    builder->target->emitBurst(builder, burstFunction, outputParams(FunctionKind::Burst));
     builder->endOfStatement(true);
+    for (auto& e : entryPoints) {
+        builder->target->emitFrom(builder, entryFunction(e.first));
+        builder->endOfStatement(true);
+    }
+    if (options.stopMask) {
+        builder->target->emitUntil(builder, untilFunction, outputParams(FunctionKind::Until));
+        builder->endOfStatement(true);
+    }
+    if (options.truncation) {
+        builder->target->emitTruncated(builder, truncatedFunction,
+                                       outputParams(FunctionKind::Truncated));
+        builder->endOfStatement(true);
+    }
+    if (options.segments) {
+        builder->target->emitSegments(builder, segmentsFunction,
+                                      outputParams(FunctionKind::Segments));
+        builder->endOfStatement(true);
+    }
+    if (!suspendStates.empty()) {
+        builder->newline();
+        emitContinuation(builder);
+        builder->target->emitSuspend(builder, suspendFunction, continuationType);
+        builder->endOfStatement(true);
+        builder->target->emitResume(builder, resumeFunction, continuationType);
+        builder->endOfStatement(true);
+    }
+    if (layoutCache != nullptr) {
+        builder->newline();
+        layoutCache->emitTypes(builder, options.layoutCache);
+        builder->target->emitCached(builder, cachedFunction, cacheType);
+        builder->endOfStatement(true);
+    }
+    if (options.reassembly != 0) {
+        builder->newline();
+        FPPFragment::emitTypes(builder, this, options.reassembly);
+    }
+    for (auto v : variants) {
+        builder->target->emitMain(builder, v->function(), outputParams(FunctionKind::Packet));
+        builder->endOfStatement(true);
+    }
+    if (!variants.empty()) {
+        builder->newline();
+        builder->appendFormat("struct %s ", variantTable.c_str());
+        builder->blockStart();
+        builder->emitIndent();
+        builder->append("const char *name");
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->target->emitMain(builder, "(*parse)", outputParams(FunctionKind::Packet));
+        builder->endOfStatement(true);
+        builder->blockEnd(false);
+        builder->endOfStatement(true);
+        builder->appendFormat("extern const struct %s %s[%u];", variantTable.c_str(),
+                              variantTable.c_str(),
+                              static_cast<unsigned>(variants.size() + 1));
+        builder->newline();
+    }
+
+    if (rewrite != nullptr)
+        rewrite->emitPrototypes(builder);
+
+    if (options.instrument) {
+        builder->appendFormat("extern uint64_t %s[%u];", profileCounters.c_str(),
+                              static_cast<unsigned>(parser->transitions.size()));
+        builder->newline();
+        builder->appendFormat("void %s(FILE *file);", profileDump.c_str());
+        builder->newline();
+    }
     builder->appendLine("#endif");
 }
 
 void FPPProgram::emitTypes(CodeBuilder* builder) {
+    bool varbits = false;
+    for (auto d : program->objects) {
+        if (auto ht = d->to<IR::Type_Header>()) {
+            for (auto f : ht->fields)
+                varbits = varbits || f->type->is<IR::Type_Varbits>();
+        }
+    }
+    if (varbits)
+        FPPVarbitType::emitViewType(builder);
+    auto tlvKinds = FPPTlv::kinds(program);
+    for (auto kind : tlvKinds)
+        FPPTlv::emitType(builder, kind);
 
-    builder->append("enum fpp_headers ");
+    builder->appendFormat("enum %s ", headersEnum.c_str());
     builder->blockStart();
     builder->emitIndent();
-    builder->append("fpp_unknown_hdr");
+    builder->append(FPPModel::reserved("unknown_hdr"));
     for (auto d : program->objects) {
         if (d->is<IR::Type>() && !d->is<IR::IContainer>() &&
             !d->is<IR::Type_Extern>() && !d->is<IR::Type_Parser>() &&
@@ -198,14 +1199,23 @@ void FPPProgram::emitTypes(CodeBuilder* builder) {
             builder->append(",");
             builder->newline();
             builder->emitIndent();
-            builder->appendFormat("fpp_%s", tmp->name);
+            builder->append(FPPModel::reserved(tmp->name));
         }
     }
+    for (auto kind : tlvKinds) {
+        builder->append(",");
+        builder->newline();
+        builder->emitIndent();
+        builder->append(FPPTlv::type(kind));
+    }
     builder->newline();
     builder->blockEnd(true);
     builder->endOfStatement(true);
     builder->newline();
 
+    if (flowKey != nullptr)
+        flowKey->emitTypes(builder);
+
     for (auto d : program->objects) {
         if (d->is<IR::Type>() && !d->is<IR::IContainer>() &&
             !d->is<IR::Type_Extern>() && !d->is<IR::Type_Parser>() &&
@@ -228,7 +1238,7 @@ class ErrorCodesVisitor : public Inspector {
     bool preorder(const IR::Type_Error* errors) override {
         for (auto m : *errors->getDeclarations()) {
             builder->emitIndent();
-            builder->appendFormat("%s,\n", m->getName().name.c_str());
+            builder->appendFormat("%s,\n", FPPModel::global(m->getName().name).c_str());
         }
         return false;
     }
@@ -244,20 +1254,55 @@ void FPPProgram::emitPreamble(CodeBuilder* builder) {
     program->apply(visitor);
 
     builder->emitIndent();
-    builder->appendLine("ParserDefaultReject,");
+    builder->appendFormat("%s,\n", defaultReject.c_str());
     builder->emitIndent();
-    builder->appendLine("OutOfMemory");
+    builder->append(outOfMemory);
+    if (options.truncation) {
+        builder->append(",");
+        builder->newline();
+        builder->emitIndent();
+        builder->append(truncatedError);
+    }
+    if (!suspendStates.empty()) {
+        builder->append(",");
+        builder->newline();
+        builder->emitIndent();
+        builder->append(suspendedError);
+    }
+    if (filter != nullptr) {
+        builder->append(",");
+        builder->newline();
+        builder->emitIndent();
+        builder->append(filteredError);
+    }
+    if (fragments) {
+        builder->append(",");
+        builder->newline();
+        builder->emitIndent();
+        builder->append(fragmentedError);
+    }
+    builder->newline();
 
     builder->blockEnd(false);
     builder->endOfStatement(true);
     builder->newline();
+    if (options.stopMask)
+        builder->appendFormat("#define %s(type) ((type) < 64 ? 1ULL << (type) : 0)\n",
+                              FPPModel::macro("FPP_STOP_BIT").c_str());
+    // With --prefix the helpers are private to the C file, where they
+    // cannot clash with the helpers of another parser.
+    if (options.prefix.isNullOrEmpty())
+        emitHelpers(builder);
+    builder->newline();
+}
+
+void FPPProgram::emitHelpers(CodeBuilder* builder) {
     builder->appendLine("#define FPP_MASK(t, w) ((((t)(1)) << (w)) - (t)1)");
     builder->appendLine("#define BYTES(w) ((w) / 8)");
     builder->appendLine("#define load_byte(ptr, bytes) (*(const uint8_t *)((const uint8_t *)(ptr) + bytes))");
     builder->appendLine("#define load_half(ptr, bytes) (*(const uint16_t *)((const uint8_t *)(ptr) + bytes))");
     builder->appendLine("#define load_word(ptr, bytes) (*(const uint32_t *)((const uint8_t *)(ptr) + bytes))");
     builder->appendLine("#define load_dword(ptr, bytes) (*(const uint64_t *)((const uint8_t *)(ptr) + bytes))");
-    builder->newline();
 }
 
 void FPPProgram::emitLocalVariables(CodeBuilder* builder) {
@@ -275,8 +1320,17 @@ void FPPProgram::emitAcceptState(CodeBuilder* builder) {
     builder->newline();
     builder->emitIndent();
     builder->blockStart();
+    if (filter != nullptr)
+        filter->emitAccept(builder);
+    if (caching) {
+        builder->emitIndent();
+        builder->appendFormat("%s(cache, &%s)", FPPModel::reserved("layout_install").c_str(),
+                              recordVar.c_str());
+        builder->endOfStatement(true);
+    }
     builder->emitIndent();
-    builder->appendLine("return NoError;");
+    emitReturn(builder, noError);
+    builder->newline();
     builder->blockEnd(true);
 }
 
@@ -25,7 +25,7 @@ limitations under the License.
 #include "ir/ir.h"
 #include "frontends/p4/typeMap.h"
 #include "frontends/p4/evaluator/evaluator.h"
-#include "frontends/common/options.h"
+#include "fppOptions.h"
 #include "codeGen.h"
 
 namespace FPP {
@@ -34,31 +34,112 @@ class FPPProgram;
 class FPPParser;
 class FPPTable;
 class FPPType;
+class FPPProfile;
+class FPPFastPath;
+class FPPParserState;
+class FPPVariant;
+class FPPFlowKey;
+class FPPPaths;
+class FPPLayoutCache;
+class FPPFilter;
+class FPPRewrite;
 
 class FPPProgram : public FPPObject {
  public:
-    const CompilerOptions& options;
+    enum class FunctionKind {
+        Packet, Burst, From, Until, Truncated, Segments, Suspend, Resume, Cached
+    };
+
+    const FPPOptions& options;
     const IR::P4Program* program;
     const IR::ToplevelBlock*  toplevel;
     P4::ReferenceMap*    refMap;
     P4::TypeMap*         typeMap;
     FPPParser*          parser;
+    FPPProfile*         profile;
+    std::vector<FPPFastPath*> fastPaths;
+    // name and first state of each @entry_point
+    std::vector<std::pair<cstring, const FPPParserState*>> entryPoints;
+    std::vector<FPPVariant*> variants;
+    // states before which the suspendable parser returns a continuation
+    std::vector<const FPPParserState*> suspendStates;
+    // fields annotated with @flow_key, nullptr if there are none
+    FPPFlowKey*         flowKey;
+    // numbered accept paths with --classify, nullptr otherwise
+    FPPPaths*           paths;
+    // header layouts replayed by the cached parser, nullptr without --layout-cache
+    FPPLayoutCache*     layoutCache;
+    // --filter and @filter clauses, nullptr if packets are not filtered
+    FPPFilter*          filter;
+    // in-place rewrite functions, nullptr without --rewrite
+    FPPRewrite*         rewrite;
     FPPModel            &model;
 
     cstring endLabel, offsetVar, lengthVar;
     cstring zeroKey, functionName, errorVar;
     cstring packetStartVar, packetEndVar, byteVar;
     cstring errorEnum;
+    cstring selectKeyVar, profileCounters, profileDump;
+    cstring fusedLabelsVar, fusedTableVar;
+    cstring fusedKeyVar, fusedClassVar, fusedClassesVar;
+    cstring targetLabelsVar, targetVar;
+    cstring burstFunction, burstIndexVar, laneMatchVar;
+    cstring untilFunction, variantTable, truncatedFunction;
+    cstring headerListType, headerListStruct, headersEnum;
+    cstring noError, defaultReject, outOfMemory, truncatedError, suspendedError;
+    cstring continuationType, suspendFunction, resumeFunction;
+    cstring segmentsFunction, segmentWindow, stitchVar;
+    cstring parserTimeout, visitsVar, tunnelsVar, unrollBaseVar;
+    cstring flowType;
+    cstring classType, headerBitsVar, pathIdVar, loopedVar, cutLabel;
+    cstring cacheType, cachedFunction, layoutVar, recordVar;
+    cstring filteredError, filteredLabel, filterSeenVar, filterMatchedVar;
+    cstring checksumL3Var;
+    cstring fragmentedError, fragmentedLabel, reassemblyType, reassembleFunction;
+    // some header types are annotated with @checksum
+    bool checksums = false;
+    // some header types are annotated with @fragment("ipv4") or ("ipv6_frag")
+    bool fragments = false;
+    // set while the parser is emitted into the loop of the burst function
+    bool burst = false;
+    // first state of the entry point being emitted, nullptr for start
+    const FPPParserState* entryState = nullptr;
+    // set while the parser stopping at the headers in 'stop' is emitted
+    bool stopping = false;
+    // set while the parser taking the wire length is emitted
+    bool truncating = false;
+    // set while the parser reading iovec segments is emitted
+    bool segmented = false;
+    // set while a parser filling the optional flow key is emitted
+    bool flowing = false;
+    // set while a parser filling the optional header bitmap and path is emitted
+    bool classifying = false;
+    // set while the suspending and the resuming parser are emitted
+    bool suspending = false;
+    bool resuming = false;
+    // set while the parser recording and replaying header layouts is emitted
+    bool caching = false;
+    // variant being emitted, nullptr for the full parser
+    const FPPVariant* variant = nullptr;
     cstring license = "GPL";  // TODO: this should be a compiler option probably
     cstring arrayIndexType = "uint32_t";
 
     virtual bool build();  // return 'true' on success
-
-    FPPProgram(const CompilerOptions &options, const IR::P4Program* program,
+    bool buildFastPaths();
+    bool buildEntryPoints();
+    bool buildVariants();
+    bool buildSuspendStates();
+    bool isSuspendState(cstring state) const;
+    cstring suspendLabel(cstring state) const;
+    // Ends parsing of the current packet with the given error code.
+    void emitReturn(CodeBuilder* builder, cstring code) const;
+
+    FPPProgram(const FPPOptions &options, const IR::P4Program* program,
                 P4::ReferenceMap* refMap, P4::TypeMap* typeMap, const IR::ToplevelBlock* toplevel) :
             options(options), program(program), toplevel(toplevel),
             refMap(refMap), typeMap(typeMap),
-            parser(nullptr), model(FPPModel::instance) {
+            parser(nullptr), profile(nullptr), flowKey(nullptr), paths(nullptr),
+            layoutCache(nullptr), filter(nullptr), rewrite(nullptr), model(FPPModel::instance) {
         offsetVar = FPPModel::reserved("packetOffsetInBits");
         zeroKey = FPPModel::reserved("zero");
         functionName = FPPModel::reserved("parse_packet");
@@ -68,6 +149,59 @@ class FPPProgram : public FPPObject {
         byteVar = FPPModel::reserved("byte");
         endLabel = FPPModel::reserved("end");
         errorEnum = FPPModel::reserved("errorCodes");
+        selectKeyVar = FPPModel::reserved("selectKey");
+        profileCounters = FPPModel::reserved("profileCounters");
+        profileDump = FPPModel::reserved("profile_dump");
+        fusedLabelsVar = FPPModel::reserved("fusedLabels");
+        fusedTableVar = FPPModel::reserved("fusedTable");
+        fusedKeyVar = FPPModel::reserved("fusedKey");
+        fusedClassVar = FPPModel::reserved("fusedClass");
+        fusedClassesVar = FPPModel::reserved("fusedClasses");
+        targetLabelsVar = FPPModel::reserved("targetLabels");
+        targetVar = FPPModel::reserved("target");
+        burstFunction = FPPModel::reserved("parse_burst");
+        burstIndexVar = FPPModel::reserved("index");
+        laneMatchVar = FPPModel::reserved("laneMatch");
+        untilFunction = FPPModel::reserved("parse_packet_until");
+        variantTable = FPPModel::reserved("variants");
+        headerListType = FPPModel::global("packet_hdr_t");
+        headerListStruct = FPPModel::global("packet_hdr_s");
+        headersEnum = FPPModel::reserved("headers");
+        noError = FPPModel::global("NoError");
+        defaultReject = FPPModel::global("ParserDefaultReject");
+        outOfMemory = FPPModel::global("OutOfMemory");
+        truncatedError = FPPModel::global("Truncated");
+        truncatedFunction = FPPModel::reserved("parse_truncated");
+        suspendedError = FPPModel::global("Suspended");
+        continuationType = FPPModel::reserved("continuation");
+        suspendFunction = FPPModel::reserved("parse_suspend");
+        resumeFunction = FPPModel::reserved("parse_resume");
+        segmentsFunction = FPPModel::reserved("parse_segments");
+        segmentWindow = FPPModel::reserved("segment_window");
+        stitchVar = FPPModel::reserved("stitch");
+        parserTimeout = FPPModel::global("ParserTimeout");
+        visitsVar = FPPModel::reserved("visits");
+        tunnelsVar = FPPModel::reserved("tunnels");
+        unrollBaseVar = FPPModel::reserved("unrollBase");
+        flowType = FPPModel::reserved("flow");
+        classType = FPPModel::reserved("class");
+        headerBitsVar = FPPModel::reserved("headerBits");
+        pathIdVar = FPPModel::reserved("pathId");
+        loopedVar = FPPModel::reserved("looped");
+        cutLabel = FPPModel::reserved("cutPath");
+        cacheType = FPPModel::reserved("layout_cache");
+        cachedFunction = FPPModel::reserved("parse_cached");
+        layoutVar = FPPModel::reserved("hit");
+        recordVar = FPPModel::reserved("record");
+        filteredError = FPPModel::global("Filtered");
+        filteredLabel = FPPModel::reserved("filtered");
+        filterSeenVar = FPPModel::reserved("filterSeen");
+        filterMatchedVar = FPPModel::reserved("filterMatched");
+        checksumL3Var = FPPModel::reserved("checksumL3");
+        fragmentedError = FPPModel::global("Fragmented");
+        fragmentedLabel = FPPModel::reserved("fragmented");
+        reassemblyType = FPPModel::reserved("reassembly");
+        reassembleFunction = FPPModel::reserved("reassemble");
     }
 
  protected:
@@ -77,6 +211,24 @@ class FPPProgram : public FPPObject {
     virtual void emitHeaderInstances(CodeBuilder* builder);
     virtual void emitLocalVariables(CodeBuilder* builder);
     virtual void emitAcceptState(CodeBuilder* builder);
+    virtual void emitProfileDump(CodeBuilder* builder);
+    virtual void emitVariantTable(CodeBuilder* builder);
+    virtual void emitHelpers(CodeBuilder* builder);
+    virtual void emitContinuation(CodeBuilder* builder);
+    virtual void emitClassTypes(CodeBuilder* builder);
+    virtual void emitSegmentWindow(CodeBuilder* builder);
+    virtual void emitSuspendStates(CodeBuilder* builder);
+    virtual void emitResumeDispatch(CodeBuilder* builder);
+    virtual void emitParserBody(CodeBuilder* builder);
+    virtual void emitEntryPoint(CodeBuilder* builder, cstring name, FunctionKind kind);
+    virtual void emitFunction(CodeBuilder* builder, cstring name, FunctionKind kind);
+    void emitSignature(CodeBuilder* builder, cstring name, FunctionKind kind) const;
+    bool hasOutputs(FunctionKind kind) const;
+    cstring outputParams(FunctionKind kind) const;
+    virtual void emitBurstBody(CodeBuilder* builder);
+    virtual void emitLaneMatch(CodeBuilder* builder);
+    cstring cloneName(cstring name, cstring isa) const;
+    cstring entryFunction(cstring name) const;
 
  public:
     virtual void emitH(CodeBuilder* builder, cstring headerFile);  // emits C headers
@@ -0,0 +1,381 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "fppRewrite.h"
+#include "fppChecksum.h"
+#include "fppModel.h"
+
+namespace FPP {
+
+namespace {
+cstring valueType(unsigned width) {
+    if (width <= 8)
+        return "uint8_t";
+    else if (width <= 16)
+        return "uint16_t";
+    else if (width <= 32)
+        return "uint32_t";
+    return "const uint8_t *";
+}
+}  // namespace
+
+void FPPRewrite::build() {
+    for (auto d : program->program->objects) {
+        auto ht = d->to<IR::Type_Header>();
+        if (ht == nullptr)
+            continue;
+
+        Header header = { ht, {}, -1, false, 0, 0, true };
+        unsigned offset = 0;
+        for (auto f : ht->fields) {
+            if (f->type->is<IR::Type_Varbits>())
+                break;
+            unsigned width = f->type->width_bits();
+            // Wider fields are byte arrays, unaligned ones are not written.
+            if (width > 32 && (offset % 8 != 0 || width % 8 != 0))
+                header.emittable = false;
+            else
+                header.fields.push_back({ f, offset, width });
+            offset += width;
+        }
+        if (!header.emittable)
+            ::warning("%1%: fields wider than 32 bits must be byte-aligned to be written", ht);
+
+        auto kind = FPPChecksum::kind(ht);
+        if (kind == "ipv4") {
+            header.addressFrom = 12;
+            header.addressTo = 20;
+        } else if (kind == "ipv6") {
+            header.addressFrom = 8;
+            header.addressTo = 40;
+        }
+        if (FPPChecksum::verified(ht)) {
+            int checksum = kind == "ipv4" ? 10 : kind == "tcp" ? 16 : 6;
+            for (auto& f : header.fields) {
+                if (f.offset == static_cast<unsigned>(checksum) * 8 && f.width == 16)
+                    header.checksum = checksum;
+            }
+            if (header.checksum < 0)
+                ::warning("%1%: no 16-bit checksum field at byte %2%, it is not updated",
+                          ht, checksum);
+            header.udp = kind == "udp";
+        }
+        headers.push_back(header);
+    }
+}
+
+void FPPRewrite::emitPrototypes(CodeBuilder* builder) const {
+    for (auto& h : headers) {
+        for (auto& f : h.fields)
+            emitSetter(builder, h, f, true);
+        if (h.emittable)
+            emitEmit(builder, h, true);
+    }
+    builder->appendFormat("void %s(uint8_t *csum, const uint8_t *old, const uint8_t *now, "
+                          "uint32_t len);", FPPModel::reserved("checksum_adjust").c_str());
+    builder->newline();
+    builder->appendFormat("uint8_t *%s(uint8_t *packet, uint32_t headroom, uint32_t offset, "
+                          "uint32_t len);", FPPModel::reserved("push").c_str());
+    builder->newline();
+    builder->appendFormat("uint8_t *%s(uint8_t *packet, uint32_t offset, uint32_t len);",
+                          FPPModel::reserved("pop").c_str());
+    builder->newline();
+    builder->appendFormat("void %s(%s *list, uint32_t from, int32_t delta);",
+                          FPPModel::reserved("shift_offsets").c_str(),
+                          program->headerListType.c_str());
+    builder->newline();
+}
+
+void FPPRewrite::emitFunctions(CodeBuilder* builder) const {
+    // Writes 'width' bits of 'value' at bit 'bit' of 'p', width <= 32.
+    builder->appendFormat("static inline void %s(uint8_t *p, uint32_t bit, unsigned width, "
+                          "uint32_t value)", FPPModel::reserved("put_bits").c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    uint8_t *b = p + bit / 8;");
+    builder->appendLine("    unsigned bytes = (bit % 8 + width + 7) / 8;");
+    builder->appendLine("    unsigned shift = bytes * 8 - bit % 8 - width;");
+    builder->appendLine("    uint64_t word = 0, mask = ((1ULL << width) - 1) << shift;");
+    builder->appendLine("    for (unsigned i = 0; i < bytes; i++)");
+    builder->appendLine("        word = word << 8 | b[i];");
+    builder->appendLine("    word = (word & ~mask) | (((uint64_t) value << shift) & mask);");
+    builder->appendLine("    for (unsigned i = bytes; i-- > 0; word >>= 8)");
+    builder->appendLine("        b[i] = (uint8_t) word;");
+    builder->blockEnd(true);
+    builder->newline();
+
+    // RFC 1624: HC' = ~(~HC + ~m + m') over the changed 16-bit words.
+    builder->appendFormat("void %s(uint8_t *csum, const uint8_t *old, const uint8_t *now, "
+                          "uint32_t len)", FPPModel::reserved("checksum_adjust").c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    uint64_t sum = (uint16_t) ~(csum[0] << 8 | csum[1]);");
+    builder->appendLine("    for (uint32_t i = 0; i + 1 < len; i += 2)");
+    builder->appendLine("        sum += (uint16_t) ~(old[i] << 8 | old[i + 1]) + (now[i] << 8 | now[i + 1]);");
+    builder->appendLine("    if (len % 2)");
+    builder->appendLine("        sum += (uint16_t) ~(old[len - 1] << 8) + (now[len - 1] << 8);");
+    builder->appendLine("    while (sum >> 16)");
+    builder->appendLine("        sum = (sum & 0xffff) + (sum >> 16);");
+    builder->appendLine("    csum[0] = (uint8_t) (~sum >> 8);");
+    builder->appendLine("    csum[1] = (uint8_t) ~sum;");
+    builder->blockEnd(true);
+    builder->newline();
+
+    for (auto& h : headers) {
+        for (auto& f : h.fields) {
+            emitSetter(builder, h, f, false);
+            builder->newline();
+        }
+        if (h.emittable) {
+            emitEmit(builder, h, false);
+            builder->newline();
+        }
+    }
+
+    // Only the bytes before the encapsulation are moved, which are
+    // usually just the link layer header.
+    builder->appendFormat("uint8_t *%s(uint8_t *packet, uint32_t headroom, uint32_t offset, "
+                          "uint32_t len)", FPPModel::reserved("push").c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    if (len > headroom)");
+    builder->appendLine("        return NULL;");
+    builder->appendLine("    memmove(packet - len, packet, offset);");
+    builder->appendLine("    return packet - len;");
+    builder->blockEnd(true);
+    builder->newline();
+
+    builder->appendFormat("uint8_t *%s(uint8_t *packet, uint32_t offset, uint32_t len)",
+                          FPPModel::reserved("pop").c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    memmove(packet + len, packet, offset);");
+    builder->appendLine("    return packet + len;");
+    builder->blockEnd(true);
+    builder->newline();
+
+    builder->appendFormat("void %s(%s *list, uint32_t from, int32_t delta)",
+                          FPPModel::reserved("shift_offsets").c_str(),
+                          program->headerListType.c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->appendLine("    for (; list != NULL; list = list->next) {");
+    builder->appendLine("        switch (list->type) {");
+    for (auto& h : headers) {
+        cstring type = FPPModel::global(h.type->name.name);
+        builder->appendFormat("        case %s:", FPPModel::reserved(h.type->name.name).c_str());
+        builder->newline();
+        builder->appendFormat("            if (((struct %s *) list->hdr)->header_offset >= from)",
+                              type.c_str());
+        builder->newline();
+        builder->appendFormat("                ((struct %s *) list->hdr)->header_offset += delta;",
+                              type.c_str());
+        builder->newline();
+        builder->appendLine("            break;");
+    }
+    builder->appendLine("        default:");
+    builder->appendLine("            break;");
+    builder->appendLine("        }");
+    builder->appendLine("    }");
+    builder->blockEnd(true);
+}
+
+// A setter writes the field in network order and adjusts the checksum of
+// its header by the change of the 16-bit words it spans.
+void FPPRewrite::emitSetter(CodeBuilder* builder, const Header& header, const Field& field,
+                            bool prototype) const {
+    cstring type = FPPModel::global(header.type->name.name);
+    cstring name = field.field->name.name;
+    bool pseudo = pseudoHeader(header, field);
+    builder->appendFormat("void %s%s_%s(uint8_t *packet, struct %s *hdr, ",
+                          FPPModel::reserved("set_").c_str(), header.type->name.name.c_str(),
+                          name.c_str(), type.c_str());
+    if (pseudo)
+        builder->appendFormat("const %s *list, ", program->headerListType.c_str());
+    builder->appendFormat("%s%svalue)", valueType(field.width).c_str(),
+                          field.width <= 32 ? " " : "");
+    if (prototype) {
+        builder->endOfStatement(true);
+        return;
+    }
+    builder->newline();
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("uint8_t *p = packet + hdr->header_offset");
+    builder->endOfStatement(true);
+
+    bool adjust = pseudo || (header.checksum >= 0 &&
+                             field.offset != static_cast<unsigned>(header.checksum) * 8);
+    unsigned from = field.offset / 16 * 2;
+    unsigned length = (field.offset + field.width + 15) / 16 * 2 - from;
+    if (adjust) {
+        builder->emitIndent();
+        builder->appendFormat("uint8_t old[%u]", length);
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("memcpy(old, p + %u, %u)", from, length);
+        builder->endOfStatement(true);
+    }
+    builder->emitIndent();
+    if (field.width <= 32) {
+        builder->appendFormat("%s(p, %u, %u, value)", FPPModel::reserved("put_bits").c_str(),
+                              field.offset, field.width);
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("hdr->%s = value", name.c_str());
+    } else {
+        builder->appendFormat("memcpy(p + %u, value, %u)", field.offset / 8, field.width / 8);
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("memcpy(hdr->%s, value, %u)", name.c_str(), field.width / 8);
+    }
+    builder->endOfStatement(true);
+    if (adjust && header.checksum >= 0)
+        emitChecksumAdjust(builder, "p", header.checksum, header.udp, from, length);
+    if (pseudo)
+        emitTransportAdjust(builder, from, length);
+    builder->blockEnd(true);
+}
+
+// The field lies within the addresses, which are whole 16-bit words of the
+// TCP and UDP pseudo-header.
+bool FPPRewrite::pseudoHeader(const Header& header, const Field& field) const {
+    return field.offset >= header.addressFrom * 8 &&
+           field.offset + field.width <= header.addressTo * 8;
+}
+
+// The TCP or UDP header covered by an IP header is the first one after it
+// in the list, unless an inner IP header comes first.
+void FPPRewrite::emitTransportAdjust(CodeBuilder* builder, unsigned from,
+                                     unsigned length) const {
+    builder->emitIndent();
+    builder->append("for (; list != NULL; list = list->next) ");
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("switch (list->type) ");
+    builder->blockStart();
+    for (auto& h : headers) {
+        auto kind = FPPChecksum::kind(h.type);
+        bool transport = h.checksum >= 0 && (kind == "tcp" || kind == "udp");
+        if (!transport && h.addressFrom == h.addressTo)
+            continue;
+        cstring type = FPPModel::global(h.type->name.name);
+        builder->emitIndent();
+        builder->appendFormat("case %s: ", FPPModel::reserved(h.type->name.name).c_str());
+        builder->blockStart();
+        builder->emitIndent();
+        builder->appendFormat("uint32_t offset = ((const struct %s *) list->hdr)->header_offset",
+                              type.c_str());
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->append("if (offset <= hdr->header_offset)");
+        builder->newline();
+        builder->increaseIndent();
+        builder->emitIndent();
+        builder->append("break;");
+        builder->newline();
+        builder->decreaseIndent();
+        if (transport) {
+            builder->emitIndent();
+            builder->append("uint8_t *l4 = packet + offset");
+            builder->endOfStatement(true);
+            emitChecksumAdjust(builder, "l4", h.checksum, h.udp, from, length);
+        }
+        builder->emitIndent();
+        builder->append("return;");
+        builder->newline();
+        builder->blockEnd(true);
+    }
+    builder->emitIndent();
+    builder->append("default:");
+    builder->newline();
+    builder->increaseIndent();
+    builder->emitIndent();
+    builder->append("break;");
+    builder->newline();
+    builder->decreaseIndent();
+    builder->blockEnd(true);
+    builder->blockEnd(true);
+}
+
+// A zero UDP checksum means none was computed; a computed zero is sent as
+// 0xffff.
+void FPPRewrite::emitChecksumAdjust(CodeBuilder* builder, cstring base, int checksum,
+                                    bool udp, unsigned from, unsigned length) const {
+    auto b = base.c_str();
+    int c = checksum;
+    builder->emitIndent();
+    if (udp) {
+        builder->appendFormat("if (%s[%d] | %s[%d]) ", b, c, b, c + 1);
+        builder->blockStart();
+        builder->emitIndent();
+    }
+    builder->appendFormat("%s(%s + %d, old, p + %u, %u)",
+                          FPPModel::reserved("checksum_adjust").c_str(), b, c, from, length);
+    builder->endOfStatement(true);
+    if (udp) {
+        builder->emitIndent();
+        builder->appendFormat("if (!(%s[%d] | %s[%d])) %s[%d] = %s[%d] = 0xff;",
+                              b, c, b, c + 1, b, c, b, c + 1);
+        builder->newline();
+        builder->blockEnd(true);
+    }
+}
+
+// Writes all fields; the IPv4 header checksum is computed over the
+// header, other checksums are written as they are in the structure.
+void FPPRewrite::emitEmit(CodeBuilder* builder, const Header& header, bool prototype) const {
+    cstring type = FPPModel::global(header.type->name.name);
+    builder->appendFormat("void %s%s(uint8_t *packet, const struct %s *hdr)",
+                          FPPModel::reserved("emit_").c_str(), header.type->name.name.c_str(),
+                          type.c_str());
+    if (prototype) {
+        builder->endOfStatement(true);
+        return;
+    }
+    builder->newline();
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("uint8_t *p = packet + hdr->header_offset");
+    builder->endOfStatement(true);
+    for (auto& f : header.fields) {
+        builder->emitIndent();
+        if (f.width <= 32)
+            builder->appendFormat("%s(p, %u, %u, hdr->%s)", FPPModel::reserved("put_bits").c_str(),
+                                  f.offset, f.width, f.field->name.name.c_str());
+        else
+            builder->appendFormat("memcpy(p + %u, hdr->%s, %u)", f.offset / 8,
+                                  f.field->name.name.c_str(), f.width / 8);
+        builder->endOfStatement(true);
+    }
+    if (header.checksum >= 0 && FPPChecksum::kind(header.type) == "ipv4") {
+        int c = header.checksum;
+        builder->emitIndent();
+        builder->appendFormat("p[%d] = p[%d] = 0", c, c + 1);
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("uint16_t sum = (uint16_t) ~%s(%s(p, (p[0] & 0x0f) * 4, 0))",
+                              FPPModel::reserved("csum_fold").c_str(),
+                              FPPModel::reserved("csum").c_str());
+        builder->endOfStatement(true);
+        builder->emitIndent();
+        builder->appendFormat("memcpy(p + %d, &sum, 2)", c);
+        builder->endOfStatement(true);
+    }
+    builder->blockEnd(true);
+}
+
+}  // namespace FPP
@@ -0,0 +1,70 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPREWRITE_H_
+#define _BACKENDS_FPP_FPPREWRITE_H_
+
+#include <vector>
+
+#include "fppProgram.h"
+
+namespace FPP {
+
+// In-place modification of parsed packets: a setter per field and an emit
+// function per header type writing the structure back at header_offset,
+// and push and pop of encapsulations moving the bytes before them into or
+// out of the headroom.
+class FPPRewrite {
+    struct Field {
+        const IR::StructField* field;
+        unsigned offset;  // in bits from the start of the header
+        unsigned width;
+    };
+    struct Header {
+        const IR::Type_Header* type;
+        // fixed fields before the first varbit field
+        std::vector<Field> fields;
+        // byte offset of the checksum covering the header, -1 if none
+        int checksum;
+        bool udp;
+        // bytes of the addresses in the TCP and UDP pseudo-header, equal if
+        // the header is not an IP header
+        unsigned addressFrom, addressTo;
+        // all fields can be written back
+        bool emittable;
+    };
+
+    const FPPProgram* program;
+    std::vector<Header> headers;
+
+    void emitSetter(CodeBuilder* builder, const Header& header, const Field& field,
+                    bool prototype) const;
+    void emitEmit(CodeBuilder* builder, const Header& header, bool prototype) const;
+    bool pseudoHeader(const Header& header, const Field& field) const;
+    void emitChecksumAdjust(CodeBuilder* builder, cstring base, int checksum, bool udp,
+                            unsigned from, unsigned length) const;
+    void emitTransportAdjust(CodeBuilder* builder, unsigned from, unsigned length) const;
+
+ public:
+    explicit FPPRewrite(const FPPProgram* program) : program(program) {}
+    void build();
+    void emitPrototypes(CodeBuilder* builder) const;
+    void emitFunctions(CodeBuilder* builder) const;
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPREWRITE_H_ */
@@ -0,0 +1,167 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "fppStaticOffsets.h"
+#include "fppProgram.h"
+#include "frontends/p4/coreLibrary.h"
+#include "frontends/p4/methodInstance.h"
+
+namespace FPP {
+
+namespace {
+const P4::ExternMethod* packetMethod(const FPPParser* parser, const IR::MethodCallExpression* mce) {
+    auto mi = P4::MethodInstance::resolve(mce, parser->program->refMap, parser->program->typeMap);
+    auto em = mi->to<P4::ExternMethod>();
+    if (em == nullptr || em->object != parser->packet)
+        return nullptr;
+    return em;
+}
+
+class ReadsLookahead : public Inspector {
+ public:
+    bool found = false;
+    bool preorder(const IR::MethodCallExpression* mce) override {
+        auto method = mce->method->to<IR::Member>();
+        if (method != nullptr &&
+            method->member.name == P4::P4CoreLibrary::instance.packetIn.lookahead.name)
+            found = true;
+        return true;
+    }
+};
+}  // namespace
+
+uint64_t FPPStaticOffsets::widthMask(unsigned width) {
+    return width >= 64 ? ~(uint64_t)0 : (((uint64_t)1) << width) - 1;
+}
+
+unsigned FPPStaticOffsets::fieldWidth(const IR::Type* type) {
+    if (type->is<IR::Type_Bits>())
+        return type->to<IR::Type_Bits>()->size;
+    if (type->is<IR::Type_Boolean>())
+        return 1;
+    return 0;
+}
+
+bool FPPStaticOffsets::simulate(const FPPParserState* ps, unsigned maxBits) {
+    auto& p4lib = P4::P4CoreLibrary::instance;
+    for (auto c : ps->state->components) {
+        ReadsLookahead lookahead;
+        c->apply(lookahead);
+        if (lookahead.found)
+            return false;
+        if (c->is<IR::AssignmentStatement>())
+            continue;
+        auto mcs = c->to<IR::MethodCallStatement>();
+        if (mcs == nullptr)
+            return false;
+        auto em = packetMethod(parser, mcs->methodCall);
+        if (em == nullptr)
+            return false;
+
+        auto args = mcs->methodCall->arguments;
+        if (em->method->name.name == p4lib.packetIn.extract.name) {
+            if (dynamic || args->size() != 1)
+                return false;
+            auto expr = args->at(0)->expression;
+            auto ht = parser->typeMap->getType(expr, true)->to<IR::Type_Header>();
+            if (ht == nullptr)
+                return false;
+            unsigned width = 0;
+            for (auto f : ht->fields) {
+                unsigned w = fieldWidth(parser->typeMap->getType(f, true));
+                if (w == 0)
+                    return false;
+                width += w;
+            }
+            if (offset + width > maxBits)
+                return false;
+            instances[expr->toString()] = offset;
+            offset += width;
+        } else if (em->method->name.name == p4lib.packetIn.advance.name) {
+            auto amount = args->at(0)->expression->to<IR::Constant>();
+            if (amount == nullptr)
+                dynamic = true;
+            else if (!dynamic)
+                offset += amount->asUnsigned();
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FPPStaticOffsets::keyBits(const IR::Expression* key, unsigned& bitOffset, unsigned& width,
+                               uint64_t& keyMask) const {
+    if (key->is<IR::Cast>()) {
+        auto cast = key->to<IR::Cast>();
+        if (!keyBits(cast->expr, bitOffset, width, keyMask))
+            return false;
+        unsigned castWidth = fieldWidth(cast->destType);
+        if (castWidth == 0)
+            return false;
+        if (castWidth < width) {
+            bitOffset += width - castWidth;
+            width = castWidth;
+            keyMask &= widthMask(width);
+        }
+        return true;
+    } else if (key->is<IR::BAnd>()) {
+        auto band = key->to<IR::BAnd>();
+        auto c = band->right->to<IR::Constant>();
+        if (c == nullptr || !keyBits(band->left, bitOffset, width, keyMask))
+            return false;
+        keyMask &= c->asUnsigned();
+        return true;
+    } else if (key->is<IR::Member>()) {
+        auto member = key->to<IR::Member>();
+        auto it = instances.find(member->expr->toString());
+        if (it == instances.end())
+            return false;
+        auto ht = parser->typeMap->getType(member->expr, true)->to<IR::Type_Header>();
+        if (ht == nullptr)
+            return false;
+        unsigned fieldOffset = 0;
+        for (auto f : ht->fields) {
+            unsigned w = fieldWidth(parser->typeMap->getType(f, true));
+            if (f->name == member->member) {
+                if (w == 0 || w > 32)
+                    return false;
+                bitOffset = it->second + fieldOffset;
+                width = w;
+                keyMask = widthMask(width);
+                return true;
+            }
+            fieldOffset += w;
+        }
+        return false;
+    } else if (key->is<IR::MethodCallExpression>()) {
+        auto mce = key->to<IR::MethodCallExpression>();
+        auto em = packetMethod(parser, mce);
+        if (dynamic || em == nullptr ||
+            em->method->name.name != P4::P4CoreLibrary::instance.packetIn.lookahead.name)
+            return false;
+        unsigned w = fieldWidth(mce->typeArguments->at(0));
+        if (w == 0 || w > 32)
+            return false;
+        bitOffset = offset;
+        width = w;
+        keyMask = widthMask(width);
+        return true;
+    }
+    return false;
+}
+
+}  // namespace FPP
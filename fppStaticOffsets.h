@@ -0,0 +1,58 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPSTATICOFFSETS_H_
+#define _BACKENDS_FPP_FPPSTATICOFFSETS_H_
+
+#include <map>
+
+#include "fppParser.h"
+
+namespace FPP {
+
+// Offsets of the headers extracted by a sequence of states, simulated at
+// compile time from a starting offset. The fast paths and the fused
+// selects use them to locate select keys in the packet.
+class FPPStaticOffsets {
+    const FPPParser* parser;
+
+ public:
+    unsigned offset;  // bits consumed so far
+    bool dynamic;  // set once the offset depends on packet contents
+    std::map<cstring, unsigned> instances;  // start of each extracted header
+
+    explicit FPPStaticOffsets(const FPPParser* parser = nullptr, unsigned offset = 0) :
+            parser(parser), offset(offset), dynamic(false) {}
+
+    // Simulates the components of a state. Returns false unless they are
+    // extracts of fixed-width headers ending within 'maxBits', advances
+    // and assignments without lookahead; no extract may follow an advance
+    // by a packet-dependent amount.
+    bool simulate(const FPPParserState* ps, unsigned maxBits = ~0u);
+    // Locates a select key: a field of an extracted header or a lookahead
+    // at the current offset, possibly cast or masked by a constant.
+    // 'keyMask' has the bits of the key that the value depends on.
+    bool keyBits(const IR::Expression* key, unsigned& bitOffset, unsigned& width,
+                 uint64_t& keyMask) const;
+
+    static uint64_t widthMask(unsigned width);
+    // Width of a bit<N> or bool type, 0 for other types.
+    static unsigned fieldWidth(const IR::Type* type);
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPSTATICOFFSETS_H_ */
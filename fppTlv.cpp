@@ -0,0 +1,223 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "fppTlv.h"
+#include "fppModel.h"
+
+namespace FPP {
+
+namespace {
+struct TlvOption {
+    unsigned    type;
+    unsigned    length;  // total length of a well-formed option
+    const char* store;   // statements storing the value at 'p'
+};
+
+struct TlvLayout {
+    const char* kind;
+    // The length byte counts the type and length bytes in TCP, not in IPv6.
+    unsigned    lengthBias;
+    // Single-byte types: TCP has end of options and NOP, IPv6 has Pad1.
+    int         end;
+    unsigned    pad;
+    std::vector<std::pair<const char*, const char*>> fields;
+    std::vector<TlvOption> options;
+};
+
+const std::vector<TlvLayout>& layouts() {
+    static const std::vector<TlvLayout> result = {
+        { "tcp", 0, 0, 1,
+          { { "uint16_t", "mss" }, { "uint8_t", "wscale" }, { "uint8_t", "sack_permitted" },
+            { "uint32_t", "ts_val" }, { "uint32_t", "ts_ecr" } },
+          { { 2, 4, "out->mss = (uint16_t) (p[2] << 8 | p[3]);" },
+            { 3, 3, "out->wscale = p[2];" },
+            { 4, 2, "out->sack_permitted = 1;" },
+            { 8, 10, "out->ts_val = (uint32_t) p[2] << 24 | p[3] << 16 | p[4] << 8 | p[5]; "
+                     "out->ts_ecr = (uint32_t) p[6] << 24 | p[7] << 16 | p[8] << 8 | p[9];" } } },
+        { "ipv6", 2, -1, 0,
+          { { "uint16_t", "router_alert" }, { "uint32_t", "jumbo_length" } },
+          { { 0x05, 4, "out->router_alert = (uint16_t) (p[2] << 8 | p[3]);" },
+            { 0xc2, 6, "out->jumbo_length = (uint32_t) p[2] << 24 | p[3] << 16 | "
+                       "p[4] << 8 | p[5];" } } },
+    };
+    return result;
+}
+
+const TlvLayout* layout(cstring kind) {
+    for (auto& l : layouts()) {
+        if (kind == l.kind)
+            return &l;
+    }
+    return nullptr;
+}
+}  // namespace
+
+cstring FPPTlv::kind(const IR::StructField* field) {
+    auto anno = field->annotations->getSingle("tlv");
+    if (anno == nullptr)
+        return nullptr;
+    auto str = anno->expr.size() == 1 ? anno->expr.at(0)->to<IR::StringLiteral>() : nullptr;
+    if (str == nullptr || layout(str->value) == nullptr) {
+        ::error("%1%: expected @tlv(\"tcp\") or @tlv(\"ipv6\")", anno);
+        return nullptr;
+    }
+    if (!field->type->is<IR::Type_Varbits>()) {
+        ::error("%1%: only varbit fields can be walked", field);
+        return nullptr;
+    }
+    return str->value;
+}
+
+std::set<cstring> FPPTlv::kinds(const IR::P4Program* program) {
+    std::set<cstring> result;
+    for (auto d : program->objects) {
+        if (auto ht = d->to<IR::Type_Header>()) {
+            for (auto f : ht->fields) {
+                auto k = kind(f);
+                if (k != nullptr)
+                    result.insert(k);
+            }
+        }
+    }
+    return result;
+}
+
+cstring FPPTlv::type(cstring kind) {
+    return FPPModel::reserved("tlv_") + kind;
+}
+
+cstring FPPTlv::walker(cstring kind) {
+    return type(kind) + "_walk";
+}
+
+// 'present' has the bit of each stored option type modulo 32, 'types'
+// lists the first types in the order of the options in the packet.
+void FPPTlv::emitType(CodeBuilder* builder, cstring kind) {
+    auto l = layout(kind);
+    builder->appendFormat("struct %s ", type(kind).c_str());
+    builder->blockStart();
+    for (auto& f : l->fields) {
+        builder->emitIndent();
+        builder->appendFormat("%s %s", f.first, f.second);
+        builder->endOfStatement(true);
+    }
+    builder->emitIndent();
+    builder->append("uint32_t present");
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->append("uint16_t count");
+    builder->endOfStatement(true);
+    builder->emitIndent();
+    builder->append("uint8_t types[16]");
+    builder->endOfStatement(true);
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+}
+
+// A well-formed option is checked once against the end of the area; a
+// known type with an unexpected length is skipped without storing it.
+void FPPTlv::emitWalker(CodeBuilder* builder, cstring kind) {
+    auto l = layout(kind);
+    builder->appendFormat("static void %s(const uint8_t *p, const uint8_t *end, struct %s *out)",
+                          walker(kind).c_str(), type(kind).c_str());
+    builder->newline();
+    builder->blockStart();
+    builder->emitIndent();
+    std::vector<cstring> labels(256, "option");
+    if (l->end >= 0)
+        labels[l->end] = "done";
+    labels[l->pad] = "pad";
+    for (auto& o : l->options)
+        labels[o.type] = cstring("type_") + Util::toString(o.type);
+    // Runs of equal labels are emitted as ranges.
+    builder->append("static void *const types[256] = {");
+    builder->increaseIndent();
+    for (unsigned first = 0, last; first < labels.size(); first = last + 1) {
+        for (last = first; last + 1 < labels.size() && labels[last + 1] == labels[first]; last++)
+            continue;
+        builder->newline();
+        builder->emitIndent();
+        if (first == last)
+            builder->appendFormat("[%u] = &&%s,", first, labels[first].c_str());
+        else
+            builder->appendFormat("[%u ... %u] = &&%s,", first, last, labels[first].c_str());
+    }
+    builder->decreaseIndent();
+    builder->newline();
+    builder->emitIndent();
+    builder->append("}");
+    builder->endOfStatement(true);
+    builder->newline();
+
+    builder->appendLine("next:");
+    builder->emitIndent();
+    builder->append("if (p >= end) return;");
+    builder->newline();
+    builder->emitIndent();
+    builder->append("if (out->count < 16) out->types[out->count] = p[0];");
+    builder->newline();
+    builder->emitIndent();
+    builder->append("out->count++;");
+    builder->newline();
+    builder->emitIndent();
+    builder->append("goto *types[p[0]];");
+    builder->newline();
+
+    builder->appendLine("pad:");
+    builder->emitIndent();
+    builder->append("p++;");
+    builder->newline();
+    builder->emitIndent();
+    builder->append("goto next;");
+    builder->newline();
+    if (l->end >= 0) {
+        builder->appendLine("done:");
+        builder->emitIndent();
+        builder->append("return;");
+        builder->newline();
+    }
+
+    cstring length = l->lengthBias == 0 ? cstring("p[1]") :
+            cstring("(") + Util::toString(l->lengthBias) + " + p[1])";
+    for (auto& o : l->options) {
+        builder->appendFormat("type_%u:", o.type);
+        builder->newline();
+        builder->emitIndent();
+        builder->appendFormat("if (p + %u <= end && %s == %u) ", o.length, length.c_str(),
+                              o.length);
+        builder->appendFormat("{ %s out->present |= 1u << (0x%02x & 31); p += %u; goto next; }",
+                              o.store, o.type, o.length);
+        builder->newline();
+        builder->emitIndent();
+        builder->append("goto option;");
+        builder->newline();
+    }
+    builder->appendLine("option:");
+    builder->emitIndent();
+    builder->appendFormat("if (p + 2 > end || %sp + %s > end) return;",
+                          l->lengthBias == 0 ? "p[1] < 2 || " : "", length.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->appendFormat("p += %s;", length.c_str());
+    builder->newline();
+    builder->emitIndent();
+    builder->append("goto next;");
+    builder->newline();
+    builder->blockEnd(true);
+}
+
+}  // namespace FPP
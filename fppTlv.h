@@ -0,0 +1,46 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPTLV_H_
+#define _BACKENDS_FPP_FPPTLV_H_
+
+#include <set>
+
+#include "ir/ir.h"
+#include "fppObject.h"
+
+namespace FPP {
+
+// Walkers of type-length-value option areas held in varbit fields
+// annotated with @tlv("tcp") or @tlv("ipv6"). A walker scans the area in
+// one loop dispatching on the type byte through a label table and stores
+// the known options into a fixed result structure.
+class FPPTlv {
+ public:
+    // Kind of the walker of a field, nullptr if the field is not annotated.
+    static cstring kind(const IR::StructField* field);
+    // Kinds used by the headers of the program.
+    static std::set<cstring> kinds(const IR::P4Program* program);
+    // Name of the result structure and of its member of the headers enum.
+    static cstring type(cstring kind);
+    static cstring walker(cstring kind);
+    static void emitType(CodeBuilder* builder, cstring kind);
+    static void emitWalker(CodeBuilder* builder, cstring kind);
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPTLV_H_ */
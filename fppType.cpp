@@ -17,6 +17,9 @@ limitations under the License.
 */
 
 #include "fppType.h"
+#include "fppModel.h"
+#include "fppChecksum.h"
+#include "fppFragment.h"
 
 namespace FPP {
 
@@ -30,6 +33,8 @@ FPPType* FPPTypeFactory::create(const IR::Type* type) {
         result = new FPPBoolType();
     } else if (type->is<IR::Type_Bits>()) {
         result = new FPPScalarType(type->to<IR::Type_Bits>());
+    } else if (type->is<IR::Type_Varbits>()) {
+        result = new FPPVarbitType(type->to<IR::Type_Varbits>());
     } else if (type->is<IR::Type_StructLike>()) {
         result = new FPPStructType(type->to<IR::Type_StructLike>());
     } else if (type->is<IR::Type_Typedef>()) {
@@ -116,6 +121,35 @@ FPPScalarType::declare(CodeBuilder* builder, cstring id, bool asPointer) {
 
 //////////////////////////////////////////////////////////
 
+void FPPVarbitType::emit(CodeBuilder* builder) {
+    builder->appendFormat("struct %s", FPPModel::reserved("varbit").c_str());
+}
+
+void
+FPPVarbitType::declare(CodeBuilder* builder, cstring id, bool asPointer) {
+    emit(builder);
+    if (asPointer)
+        builder->append("*");
+    builder->spc();
+    builder->append(id);
+}
+
+void FPPVarbitType::emitViewType(CodeBuilder* builder) {
+    builder->appendFormat("struct %s ", FPPModel::reserved("varbit").c_str());
+    builder->blockStart();
+    builder->emitIndent();
+    builder->append("uint32_t offset;  /* in bits from the start of the packet */");
+    builder->newline();
+    builder->emitIndent();
+    builder->append("uint32_t length;  /* in bits */");
+    builder->newline();
+    builder->blockEnd(false);
+    builder->endOfStatement(true);
+    builder->newline();
+}
+
+//////////////////////////////////////////////////////////
+
 FPPStructType::FPPStructType(const IR::Type_StructLike* strct) :
         FPPType(strct) {
     if (strct->is<IR::Type_Struct>())
@@ -146,7 +180,7 @@ FPPStructType::FPPStructType(const IR::Type_StructLike* strct) :
 void
 FPPStructType::declare(CodeBuilder* builder, cstring id, bool asPointer) {
     builder->append(kind);
-    const char* n = name.c_str();
+    const char* n = FPPModel::global(name).c_str();
     builder->appendFormat(" %s", n);
     if (asPointer)
         builder->append("*");
@@ -176,7 +210,7 @@ void FPPStructType::emit(CodeBuilder* builder) {
     builder->emitIndent();
     builder->append(kind);
     builder->spc();
-    builder->append(name);
+    builder->append(FPPModel::global(name));
     builder->spc();
     builder->blockStart();
 
@@ -209,6 +243,16 @@ void FPPStructType::emit(CodeBuilder* builder) {
             type->declare(builder, "header_valid", false);
             builder->endOfStatement(true);
         }
+        if (FPPChecksum::verified(this->type->to<IR::Type_Header>())) {
+            builder->emitIndent();
+            builder->append("uint8_t checksum_valid");
+            builder->endOfStatement(true);
+        }
+        if (FPPFragment::flagged(this->type->to<IR::Type_Header>())) {
+            builder->emitIndent();
+            builder->append("uint8_t fragmented");
+            builder->endOfStatement(true);
+        }
     }
 
     builder->blockEnd(false);
@@ -219,7 +263,7 @@ void FPPStructType::emitType(CodeBuilder* builder) {
     builder->emitIndent();
     builder->append(kind);
     builder->spc();
-    builder->append(name);
+    builder->append(FPPModel::global(name));
 }
 
 ///////////////////////////////////////////////////////////////
@@ -256,7 +300,7 @@ unsigned FPPTypeName::implementationWidthInBits() {
 
 void FPPEnumType::declare(FPP::CodeBuilder* builder, cstring id, bool asPointer) {
     builder->append("enum ");
-    builder->append(getType()->name);
+    builder->append(FPPModel::global(getType()->name));
     if (asPointer)
         builder->append("*");
     builder->append(" ");
@@ -266,10 +310,10 @@ void FPPEnumType::declare(FPP::CodeBuilder* builder, cstring id, bool asPointer)
 void FPPEnumType::emit(FPP::CodeBuilder* builder) {
     builder->append("enum ");
     auto et = getType();
-    builder->append(et->name);
+    builder->append(FPPModel::global(et->name));
     builder->blockStart();
     for (auto m : et->members) {
-        builder->append(m->name);
+        builder->append(FPPModel::global(m->name));
         builder->appendLine(",");
     }
     builder->blockEnd(true);
@@ -278,7 +322,7 @@ void FPPEnumType::emit(FPP::CodeBuilder* builder) {
 void FPPEnumType::emitType(FPP::CodeBuilder* builder) {
     builder->append("enum ");
     auto et = getType();
-    builder->append(et->name);
+    builder->append(FPPModel::global(et->name));
 }
 
 }  // namespace FPP
@@ -98,6 +98,24 @@ class FPPScalarType : public FPPType, public IHasWidth {
     { return width <= 32; }
 };
 
+// A varbit field is a view of its bits in the packet rather than a copy:
+// the bit offset from the start of the packet and the extracted length.
+// It adds no fixed width to the header.
+class FPPVarbitType : public FPPType, public IHasWidth {
+ public:
+    const unsigned maxWidth;
+    explicit FPPVarbitType(const IR::Type_Varbits* type) :
+            FPPType(type), maxWidth(type->size) {}
+    void emit(CodeBuilder* builder) override;
+    void emitType(CodeBuilder* builder) override { emit(builder); }
+    void declare(CodeBuilder* builder, cstring id, bool asPointer) override;
+    void emitInitializer(CodeBuilder* builder) override
+    { builder->append("{ 0, 0 }"); }
+    unsigned widthInBits() override { return 0; }
+    unsigned implementationWidthInBits() override { return 64; }
+    static void emitViewType(CodeBuilder* builder);
+};
+
 // This should not always implement IHasWidth, but it may...
 class FPPTypeName : public FPPType, public IHasWidth {
     const IR::Type_Name* type;
@@ -0,0 +1,100 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <string.h>
+
+#include "fppVariant.h"
+#include "fppModel.h"
+#include "fppFilter.h"
+#include "frontends/p4/coreLibrary.h"
+#include "frontends/p4/methodInstance.h"
+
+namespace FPP {
+
+FPPVariant* FPPVariant::parse(const FPPParser* parser, cstring spec) {
+    const char* eq = strchr(spec.c_str(), '=');
+    if (eq == nullptr || eq == spec.c_str()) {
+        ::error("--variant %1%: expected name=member[,member...]", spec);
+        return nullptr;
+    }
+    auto variant = new FPPVariant(parser, spec.before(eq));
+
+    auto type = parser->typeMap->getType(parser->headers, true)->to<IR::Type_StructLike>();
+    auto copy = strdup(eq + 1);
+    for (auto m = strtok(copy, ","); m != nullptr; m = strtok(nullptr, ",")) {
+        if (type == nullptr || type->getField(m) == nullptr) {
+            ::error("--variant %1%: %2% is not a member of %3%", spec, m,
+                    parser->headers->name);
+            free(copy);
+            return nullptr;
+        }
+        variant->keep.insert(cstring(m));
+    }
+    free(copy);
+    return variant;
+}
+
+// Member of the headers structure extracted by a component, if any.
+cstring FPPVariant::extractedMember(const IR::StatOrDecl* component) const {
+    auto mcs = component->to<IR::MethodCallStatement>();
+    if (mcs == nullptr)
+        return nullptr;
+    auto mi = P4::MethodInstance::resolve(mcs->methodCall, parser->program->refMap,
+                                          parser->program->typeMap);
+    auto em = mi->to<P4::ExternMethod>();
+    if (em == nullptr || em->object != parser->packet ||
+        em->method->name.name != P4::P4CoreLibrary::instance.packetIn.extract.name ||
+        mcs->methodCall->arguments->size() != 1)
+        return nullptr;
+
+    auto member = mcs->methodCall->arguments->at(0)->expression->to<IR::Member>();
+    if (member == nullptr || !member->expr->is<IR::PathExpression>() ||
+        member->expr->to<IR::PathExpression>()->path->name.name != parser->headers->name.name)
+        return nullptr;
+    return member->member.name;
+}
+
+void FPPVariant::build() {
+    for (auto ps : parser->states) {
+        for (auto c : ps->state->components) {
+            cstring member = extractedMember(c);
+            // Members evaluated by the filter keep their states live.
+            auto filter = parser->program->filter;
+            if (!member.isNullOrEmpty() &&
+                (keeps(member) || (filter != nullptr && filter->uses(member))))
+                live.insert(ps->state->name.name);
+        }
+    }
+
+    // A state is live if a live state is reachable from it.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto t : parser->transitions) {
+            cstring from = t->from->state->name.name;
+            if (!isLive(from) && isLive(t->to)) {
+                live.insert(from);
+                changed = true;
+            }
+        }
+    }
+}
+
+cstring FPPVariant::function() const {
+    return FPPModel::reserved("parse_") + name;
+}
+
+}  // namespace FPP
@@ -0,0 +1,54 @@
+/*
+Copyright 2019 CESNET
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _BACKENDS_FPP_FPPVARIANT_H_
+#define _BACKENDS_FPP_FPPVARIANT_H_
+
+#include <set>
+
+#include "fppParser.h"
+
+namespace FPP {
+
+// Parse function specialized to a subset of the members of the headers
+// structure. Other members are still extracted when the parser needs them
+// to select transitions, but into a stack copy which is not added to the
+// output list. States from which no kept member can be extracted are dead
+// and transitions into them accept the packet.
+class FPPVariant {
+    const FPPParser* parser;
+    std::set<cstring> live;
+
+    cstring extractedMember(const IR::StatOrDecl* component) const;
+
+ public:
+    cstring name;
+    std::set<cstring> keep;
+
+    FPPVariant(const FPPParser* parser, cstring name) : parser(parser), name(name) {}
+
+    // Parses "name=member[,member...]"; returns nullptr on error.
+    static FPPVariant* parse(const FPPParser* parser, cstring spec);
+    void build();
+
+    bool keeps(cstring member) const { return keep.count(member) != 0; }
+    bool isLive(cstring state) const { return live.count(state) != 0; }
+    cstring function() const;
+};
+
+}  // namespace FPP
+
+#endif /* _BACKENDS_FPP_FPPVARIANT_H_ */
@@ -18,6 +18,7 @@ limitations under the License.
 
 #include "target.h"
 #include "fppType.h"
+#include "fppModel.h"
 
 namespace FPP {
 
@@ -27,11 +28,72 @@ void CTarget::emitIncludes(Util::SourceCodeBuilder* builder) const {
     builder->append("#include <arpa/inet.h>\n");
 }
 
+void AVX2Target::emitIncludes(Util::SourceCodeBuilder* builder) const {
+    CTarget::emitIncludes(builder);
+    builder->append("#include <immintrin.h>\n");
+}
+
 void CTarget::emitLicense(Util::SourceCodeBuilder*, cstring) const {}
 
 void CTarget::emitMain(Util::SourceCodeBuilder* builder,
-                                   cstring functionName) const {
-    builder->appendFormat("int %s(const uint8_t *packet, uint32_t packet_len, packet_hdr_t **out)", functionName);
+                                   cstring functionName, cstring outputs) const {
+    builder->appendFormat("int %s(const uint8_t *packet, uint32_t packet_len, %s **out%s)", functionName,
+                          FPPModel::global("packet_hdr_t").c_str(), outputs.c_str());
+}
+
+void CTarget::emitBurst(Util::SourceCodeBuilder* builder,
+                        cstring functionName, cstring outputs) const {
+    builder->appendFormat("void %s(const uint8_t **packets, const uint32_t *lens, uint32_t n, "
+                          "%s **outs, int *results%s)", functionName,
+                          FPPModel::global("packet_hdr_t").c_str(), outputs.c_str());
+}
+
+void CTarget::emitFrom(Util::SourceCodeBuilder* builder,
+                       cstring functionName) const {
+    builder->appendFormat("int %s(const uint8_t *packet, uint32_t packet_len, uint32_t offset, "
+                          "%s **out)", functionName, FPPModel::global("packet_hdr_t").c_str());
+}
+
+void CTarget::emitUntil(Util::SourceCodeBuilder* builder,
+                        cstring functionName, cstring outputs) const {
+    builder->appendFormat("int %s(const uint8_t *packet, uint32_t packet_len, uint64_t stop, "
+                          "%s **out%s)", functionName, FPPModel::global("packet_hdr_t").c_str(),
+                          outputs.c_str());
+}
+
+void CTarget::emitTruncated(Util::SourceCodeBuilder* builder,
+                            cstring functionName, cstring outputs) const {
+    builder->appendFormat("int %s(const uint8_t *packet, uint32_t packet_len, uint32_t wire_len, "
+                          "%s **out%s)", functionName, FPPModel::global("packet_hdr_t").c_str(),
+                          outputs.c_str());
+}
+
+void CTarget::emitSegments(Util::SourceCodeBuilder* builder,
+                           cstring functionName, cstring outputs) const {
+    builder->appendFormat("int %s(const struct iovec *segs, uint32_t nsegs, %s **out%s)",
+                          functionName, FPPModel::global("packet_hdr_t").c_str(),
+                          outputs.c_str());
+}
+
+void CTarget::emitSuspend(Util::SourceCodeBuilder* builder, cstring functionName,
+                          cstring continuationType) const {
+    builder->appendFormat("int %s(const uint8_t *packet, uint32_t packet_len, "
+                          "struct %s *cont, %s **out)", functionName.c_str(),
+                          continuationType.c_str(), FPPModel::global("packet_hdr_t").c_str());
+}
+
+void CTarget::emitResume(Util::SourceCodeBuilder* builder, cstring functionName,
+                         cstring continuationType) const {
+    builder->appendFormat("int %s(const struct %s *cont, const uint8_t *packet, "
+                          "uint32_t packet_len, %s **out)", functionName.c_str(),
+                          continuationType.c_str(), FPPModel::global("packet_hdr_t").c_str());
+}
+
+void CTarget::emitCached(Util::SourceCodeBuilder* builder, cstring functionName,
+                         cstring cacheType) const {
+    builder->appendFormat("int %s(const uint8_t *packet, uint32_t packet_len, "
+                          "struct %s *cache, %s **out)", functionName.c_str(),
+                          cacheType.c_str(), FPPModel::global("packet_hdr_t").c_str());
 }
 
 }  // namespace FPP
@@ -40,23 +40,62 @@ class Target {
     virtual void emitLicense(Util::SourceCodeBuilder* builder, cstring license) const = 0;
     virtual void emitCodeSection(Util::SourceCodeBuilder* builder, cstring sectionName) const = 0;
     virtual void emitIncludes(Util::SourceCodeBuilder* builder) const = 0;
+    // 'outputs' are optional output parameters appended to the signature,
+    // each preceded by ", ".
     virtual void emitMain(Util::SourceCodeBuilder* builder,
+                          cstring functionName, cstring outputs) const = 0;
+    virtual void emitBurst(Util::SourceCodeBuilder* builder,
+                           cstring functionName, cstring outputs) const = 0;
+    virtual void emitFrom(Util::SourceCodeBuilder* builder,
                           cstring functionName) const = 0;
+    virtual void emitUntil(Util::SourceCodeBuilder* builder,
+                           cstring functionName, cstring outputs) const = 0;
+    virtual void emitTruncated(Util::SourceCodeBuilder* builder,
+                               cstring functionName, cstring outputs) const = 0;
+    virtual void emitSegments(Util::SourceCodeBuilder* builder,
+                              cstring functionName, cstring outputs) const = 0;
+    virtual void emitSuspend(Util::SourceCodeBuilder* builder, cstring functionName,
+                             cstring continuationType) const = 0;
+    virtual void emitResume(Util::SourceCodeBuilder* builder, cstring functionName,
+                            cstring continuationType) const = 0;
+    virtual void emitCached(Util::SourceCodeBuilder* builder, cstring functionName,
+                            cstring cacheType) const = 0;
     virtual cstring dataOffset(cstring base) const = 0;
     virtual cstring dataEnd(cstring base) const = 0;
     virtual cstring forwardReturnCode() const = 0;
     virtual cstring dropReturnCode() const = 0;
     virtual cstring abortReturnCode() const = 0;
+    // Packets whose fast paths are verified together in the burst function.
+    virtual unsigned lanes() const { return 1; }
 };
 
 class CTarget : public Target {
+ protected:
+    explicit CTarget(cstring name) : Target(name) {}
+
  public:
     CTarget() : Target("C") {}
     void emitLicense(Util::SourceCodeBuilder* builder, cstring license) const override;
     void emitCodeSection(Util::SourceCodeBuilder*, cstring) const override {}
     void emitIncludes(Util::SourceCodeBuilder* builder) const override;
     void emitMain(Util::SourceCodeBuilder* builder,
+                  cstring functionName, cstring outputs) const override;
+    void emitBurst(Util::SourceCodeBuilder* builder,
+                   cstring functionName, cstring outputs) const override;
+    void emitFrom(Util::SourceCodeBuilder* builder,
                   cstring functionName) const override;
+    void emitUntil(Util::SourceCodeBuilder* builder,
+                   cstring functionName, cstring outputs) const override;
+    void emitTruncated(Util::SourceCodeBuilder* builder,
+                       cstring functionName, cstring outputs) const override;
+    void emitSegments(Util::SourceCodeBuilder* builder,
+                      cstring functionName, cstring outputs) const override;
+    void emitSuspend(Util::SourceCodeBuilder* builder, cstring functionName,
+                     cstring continuationType) const override;
+    void emitResume(Util::SourceCodeBuilder* builder, cstring functionName,
+                    cstring continuationType) const override;
+    void emitCached(Util::SourceCodeBuilder* builder, cstring functionName,
+                    cstring cacheType) const override;
     cstring dataOffset(cstring base) const override { return base; }
     cstring dataEnd(cstring base) const override
     { return cstring("(") + base + " + " + base + "->len)"; }
@@ -65,6 +104,16 @@ class CTarget : public Target {
     cstring abortReturnCode() const override { return "1"; }
 };
 
+// C with AVX2 intrinsics: the burst function verifies the fast paths of
+// four packets at once using masked 64-bit gathers. The state machine is
+// not vectorized, so the target is only accepted with fast paths.
+class AVX2Target : public CTarget {
+ public:
+    AVX2Target() : CTarget("AVX2") {}
+    void emitIncludes(Util::SourceCodeBuilder* builder) const override;
+    unsigned lanes() const override { return 4; }
+};
+
 }  // namespace FPP
 
 #endif /* _BACKENDS_FPP_TARGET_H_ */